@@ -8,12 +8,15 @@
 #include "../common/format.hpp"
 #include "../surface/surface.hpp"
 #include "../common/util.hpp"
+#include "../common/thread-pool.hpp"
+#include "../common/numa.hpp"
 
 BVH::BVH(const BoundingBox &BB, 
          const std::vector<std::shared_ptr<Surface::Base>> &surfaces, 
          const nlohmann::json &j)
 {
     df_idx = 0;
+    parallel_depth = std::numeric_limits<size_t>::max();
 
     std::shared_ptr<BuildNode> root = std::make_shared<BuildNode>();
     root->BB = BB;
@@ -28,14 +31,16 @@ BVH::BVH(const BoundingBox &BB,
         bins_per_axis = getOptional(j, "bins_per_axis", 8);
         std::cout << "\nBuilding quaternary BVH using SAH.\n\n";
         root->surfaces = surfaces;
-        recursiveBuildQuaternarySAH(root);
+        parallel_depth = parallelDepth(4);
+        recursiveBuildQuaternarySAH(root, 0);
     }
     else if (type == "BINARY_SAH")
     {
         bins_per_axis = getOptional(j, "bins_per_axis", 16);
         std::cout << "\nBuilding binary BVH using SAH.\n\n";
         root->surfaces = surfaces;
-        recursiveBuildBinarySAH(root);
+        parallel_depth = parallelDepth(2);
+        recursiveBuildBinarySAH(root, 0);
     }
     else // OCTREE
     {
@@ -54,6 +59,21 @@ BVH::BVH(const BoundingBox &BB,
         recursiveBuildFromOctree(hierarchy, root);
     }
 
+    // Subtrees below the parallel depth are built by the thread pool. Their nodes are indexed afterwards,
+    // in the same depth-first order as a sequential build, so the tree doesn't depend on the threads.
+    std::future<void> done = ThreadPool::get().forEachWorker([this](size_t)
+    {
+        size_t i;
+        while ((i = next_subtree++) < subtrees.size())
+        {
+            subtrees[i]();
+        }
+    });
+    ThreadPool::get().wait(done);
+    subtrees.clear();
+
+    index(root);
+
     size_t num_nodes = 1;
     double num_branchings = 0.0;
     for (const auto &b : branching)
@@ -76,18 +96,61 @@ BVH::BVH(const BoundingBox &BB,
               << ". Branching factor of tree: " << (num_nodes - 1) / num_branchings << std::endl;
 }
 
+BVH::BVH(const BVH &bvh, const std::unordered_map<const Surface::Base*, std::shared_ptr<Surface::Base>> &replacements)
+    : branching(bvh.branching), bins_per_axis(bvh.bins_per_axis), linear_tree(bvh.linear_tree),
+      df_idx(bvh.df_idx), parallel_depth(bvh.parallel_depth)
+{
+    ordered_surfaces.reserve(bvh.ordered_surfaces.size());
+    for (const auto &surface : bvh.ordered_surfaces)
+    {
+        ordered_surfaces.push_back(replacements.at(surface.get()));
+    }
+
+    if (!bvh.node_replicas.empty())
+    {
+        replicateNodes();
+    }
+}
+
+// Depth with at least 4 subtrees per thread, unless there is only one thread
+size_t BVH::parallelDepth(size_t branching_factor) const
+{
+    size_t num_threads = ThreadPool::get().size();
+    if (num_threads <= 1)
+    {
+        return std::numeric_limits<size_t>::max();
+    }
+
+    size_t depth = 0;
+    for (size_t n = 1; n < 4 * num_threads; n *= branching_factor)
+    {
+        depth++;
+    }
+    return depth;
+}
+
+void BVH::replicateNodes()
+{
+    if (NUMA::numNodes() > 1)
+    {
+        node_replicas = NUMA::replicate(linear_tree);
+    }
+}
+
 Intersection BVH::intersect(const Ray& ray)
 {
+    const auto &nodes = node_replicas.empty() ? linear_tree : *node_replicas[NUMA::currentNode()];
+
     Intersection intersect;
     double t;
-    if (linear_tree[0].BB.intersect(ray, t))
+    if (nodes[0].BB.intersect(ray, t))
     {
         std::priority_queue<LinearNode::NodeIntersection> to_visit;
         uint32_t node_idx = 0;
 
         while (true)
         {
-            const auto &node = linear_tree[node_idx];
+            const auto &node = nodes[node_idx];
 
             if (node.num_surfaces)
             {
@@ -110,11 +173,11 @@ Intersection BVH::intersect(const Ray& ray)
                 uint32_t child_idx = node_idx + 1;
                 while (child_idx != 0)
                 {
-                    if (linear_tree[child_idx].BB.intersect(ray, t) && t < intersect.t)
+                    if (nodes[child_idx].BB.intersect(ray, t) && t < intersect.t)
                     {
                         to_visit.emplace(child_idx, t);
                     }
-                    child_idx = linear_tree[child_idx].next_sibling;
+                    child_idx = nodes[child_idx].next_sibling;
                 }
             }
 
@@ -132,8 +195,6 @@ Intersection BVH::intersect(const Ray& ray)
 
 void BVH::recursiveBuildFromOctree(const Octree<SurfaceCentroid> &octree_node, std::shared_ptr<BuildNode> bvh_node)
 {
-    bvh_node->df_idx = df_idx++;
-
     BoundingBox BB;
 
     if (octree_node.leaf())
@@ -147,26 +208,27 @@ void BVH::recursiveBuildFromOctree(const Octree<SurfaceCentroid> &octree_node, s
     }
     else
     {
-        size_t num_children = 0;
         for (size_t i = 0; i < octree_node.octants.size(); i++)
         {
             if (!(octree_node.octants[i]->leaf() && octree_node.octants[i]->data_vec.empty()))
             {
-                num_children++;
                 std::shared_ptr<BuildNode> child = std::make_shared<BuildNode>();
                 bvh_node->children.push_back(child);
                 recursiveBuildFromOctree(*octree_node.octants[i], child);
                 BB.merge(child->BB);
             }
         }
-        branching[num_children]++;
     }
     bvh_node->BB = BB;
 }
 
-void BVH::recursiveBuildBinarySAH(std::shared_ptr<BuildNode> bvh_node)
+void BVH::recursiveBuildBinarySAH(std::shared_ptr<BuildNode> bvh_node, size_t depth)
 {
-    bvh_node->df_idx = df_idx++;
+    if (depth == parallel_depth)
+    {
+        subtrees.emplace_back([this, bvh_node]() { recursiveBuildBinarySAH(bvh_node, parallel_depth + 1); });
+        return;
+    }
 
     auto &S = bvh_node->surfaces;
 
@@ -260,28 +322,26 @@ void BVH::recursiveBuildBinarySAH(std::shared_ptr<BuildNode> bvh_node)
     }
 
     S.clear();
-   
-    size_t num_children = 0;
 
     if (!A->surfaces.empty())
     {
-        num_children++;
         bvh_node->children.push_back(A);
-        recursiveBuildBinarySAH(A);
+        recursiveBuildBinarySAH(A, depth + 1);
     }
     if (!B->surfaces.empty())
     {
-        num_children++;
         bvh_node->children.push_back(B);
-        recursiveBuildBinarySAH(B);
+        recursiveBuildBinarySAH(B, depth + 1);
     }
-
-    branching[num_children]++;
 }
 
-void BVH::recursiveBuildQuaternarySAH(std::shared_ptr<BuildNode> bvh_node)
+void BVH::recursiveBuildQuaternarySAH(std::shared_ptr<BuildNode> bvh_node, size_t depth)
 {
-    bvh_node->df_idx = df_idx++;
+    if (depth == parallel_depth)
+    {
+        subtrees.emplace_back([this, bvh_node]() { recursiveBuildQuaternarySAH(bvh_node, parallel_depth + 1); });
+        return;
+    }
 
     glm::ivec2 num_bins(bins_per_axis);
 
@@ -397,18 +457,29 @@ void BVH::recursiveBuildQuaternarySAH(std::shared_ptr<BuildNode> bvh_node)
 
     S.clear();
 
-    size_t num_children = 0;
-
     for (const auto &child : new_nodes)
     {
         if (child)
         {
-            num_children++;
             bvh_node->children.push_back(child);
-            recursiveBuildQuaternarySAH(child);
+            recursiveBuildQuaternarySAH(child, depth + 1);
         }
     }
-    branching[num_children]++;
+}
+
+void BVH::index(std::shared_ptr<BuildNode> bvh_node)
+{
+    bvh_node->df_idx = df_idx++;
+
+    if (!bvh_node->children.empty())
+    {
+        branching[bvh_node->children.size()]++;
+    }
+
+    for (const auto &child : bvh_node->children)
+    {
+        index(child);
+    }
 }
 
 void BVH::compact(std::shared_ptr<BuildNode> bvh_node, uint32_t next_sibling, uint32_t &surface_idx)
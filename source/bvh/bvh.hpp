@@ -1,5 +1,10 @@
 #pragma once
 
+#include <vector>
+#include <functional>
+#include <atomic>
+#include <unordered_map>
+
 #include <nlohmann/json.hpp>
 
 #include "../ray/intersection.hpp"
@@ -87,8 +92,14 @@ public:
         const std::vector<std::shared_ptr<Surface::Base>> &surfaces, 
         const nlohmann::json &j);
 
+    // Copy of the tree that intersects the replacements of the surfaces it was built from instead
+    BVH(const BVH &bvh, const std::unordered_map<const Surface::Base*, std::shared_ptr<Surface::Base>> &replacements);
+
     Intersection intersect(const Ray& ray);
 
+    // Copies the node array to each NUMA node, traversal then uses the copy on the node of the calling thread
+    void replicateNodes();
+
     const size_t leaf_surfaces = 8;
     const size_t max_leaf_surfaces = 0xFF;
     std::map<size_t, size_t> branching;
@@ -97,15 +108,23 @@ public:
 
 private:
     void recursiveBuildFromOctree(const Octree<SurfaceCentroid> &octree_node, std::shared_ptr<BuildNode> bvh_node);
-    void recursiveBuildBinarySAH(std::shared_ptr<BuildNode> bvh_node);
-    void recursiveBuildQuaternarySAH(std::shared_ptr<BuildNode> bvh_node);
+    void recursiveBuildBinarySAH(std::shared_ptr<BuildNode> bvh_node, size_t depth);
+    void recursiveBuildQuaternarySAH(std::shared_ptr<BuildNode> bvh_node, size_t depth);
+    void index(std::shared_ptr<BuildNode> bvh_node);
+    size_t parallelDepth(size_t branching_factor) const;
     void compact(std::shared_ptr<BuildNode> bvh_node, uint32_t next_sibling, uint32_t &surface_idx);
 
     // Nodes stored in depth-first order
     std::vector<LinearNode> linear_tree;
+    std::vector<std::unique_ptr<std::vector<LinearNode>>> node_replicas;
 
     std::vector<std::shared_ptr<Surface::Base>> ordered_surfaces;
 
     // Depth first index used during construction
     uint32_t df_idx;
+
+    // Nodes at this depth are built as separate subtrees by the thread pool
+    size_t parallel_depth;
+    std::vector<std::function<void()>> subtrees;
+    std::atomic_size_t next_subtree = 0;
 };
\ No newline at end of file
@@ -0,0 +1,94 @@
+#include "radiance-cache.hpp"
+
+#include <glm/glm.hpp>
+#include <glm/gtx/component_wise.hpp>
+
+#include "../common/util.hpp"
+#include "../random/random.hpp"
+
+RadianceCache::RadianceCache(const BoundingBox& BB, const nlohmann::json& j) : origin(BB.min)
+{
+    termination_depth = getOptional(j, "termination_depth", 2);
+    min_samples = getOptional(j, "min_samples", 16);
+
+    double cell_size = getOptional(j, "cell_size", glm::compMax(BB.dimensions()) / 512.0);
+    inv_cell_size = 1.0 / cell_size;
+
+    // Round up to a power of two to map hashes to cells with a mask
+    size_t min_size = getOptional<size_t>(j, "size", size_t(1) << 20);
+    size = 1;
+    while (size < min_size) size <<= 1;
+
+    cells = std::make_unique<Cell[]>(size);
+}
+
+void RadianceCache::record(const glm::dvec3& position, const glm::dvec3& normal, const glm::dvec3& radiance)
+{
+    if (!std::isfinite(glm::compAdd(radiance))) return;
+
+    Cell* cell = find(key(position, normal), true);
+    if (!cell) return;
+
+    for (uint8_t c = 0; c < 3; c++)
+    {
+        cell->radiance[c].add(radiance[c]);
+    }
+    cell->num_samples.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool RadianceCache::lookup(const glm::dvec3& position, const glm::dvec3& normal, glm::dvec3& radiance) const
+{
+    const Cell* cell = find(key(position, normal), false);
+    if (!cell) return false;
+
+    uint32_t num_samples = cell->num_samples.load(std::memory_order_relaxed);
+    if (num_samples < min_samples) return false;
+
+    radiance = glm::dvec3(cell->radiance[0], cell->radiance[1], cell->radiance[2]) / static_cast<double>(num_samples);
+    return true;
+}
+
+// Packs 19 bits per quantized position coordinate and 3 bins per normal component
+uint64_t RadianceCache::key(const glm::dvec3& position, const glm::dvec3& normal) const
+{
+    const uint64_t mask = (uint64_t(1) << 19) - 1;
+
+    glm::dvec3 p = glm::floor((position - origin) * inv_cell_size);
+    glm::dvec3 n = glm::clamp(glm::floor((normal + 1.0) * 1.5), 0.0, 2.0);
+
+    uint64_t key = 0;
+    for (uint8_t c = 0; c < 3; c++)
+    {
+        key = (key << 19) | (static_cast<uint64_t>(std::max(p[c], 0.0)) & mask);
+    }
+    key = (key << 5) | static_cast<uint64_t>(n.x + 3.0 * n.y + 9.0 * n.z);
+
+    // Reserve 0 for unclaimed cells
+    return key + 1;
+}
+
+RadianceCache::Cell* RadianceCache::find(uint64_t key, bool claim) const
+{
+    // Spreads neighbouring cells over the table
+    uint64_t h = Random::mix(key);
+
+    for (size_t i = 0; i < max_probes; i++)
+    {
+        Cell& cell = cells[(h + i) & (size - 1)];
+
+        uint64_t cell_key = cell.key.load(std::memory_order_relaxed);
+        if (cell_key == key) return &cell;
+
+        if (cell_key == 0)
+        {
+            if (!claim) return nullptr;
+
+            // On failure cell_key is the key of the thread that claimed the cell
+            if (cell.key.compare_exchange_strong(cell_key, key, std::memory_order_relaxed) || cell_key == key)
+            {
+                return &cell;
+            }
+        }
+    }
+    return nullptr;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <memory>
+#include <array>
+#include <atomic>
+
+#include <glm/vec3.hpp>
+
+#include <nlohmann/json.hpp>
+
+#include "../common/bounding-box.hpp"
+#include "../common/atomic-double.hpp"
+
+/*********************************************************************************
+World space radiance cache stored in a fixed size hash table. Cells are keyed by
+the quantized position and normal of diffuse interactions, and accumulate the
+reflected radiance of the paths that pass through them.
+
+The table is lock-free. Cells are claimed by compare-and-swap on the key with
+bounded linear probing, and radiance is accumulated with atomic adds. Samples are
+dropped if no cell can be claimed. The sum and sample count of a cell are updated
+separately, so a concurrent lookup may see one without the other, which is a
+negligible part of the bias of the cache.
+**********************************************************************************/
+
+class RadianceCache
+{
+public:
+    RadianceCache(const BoundingBox& BB, const nlohmann::json& j);
+
+    // Thread safe
+    void record(const glm::dvec3& position, const glm::dvec3& normal, const glm::dvec3& radiance);
+
+    // Returns false if the cell has fewer than min_samples samples
+    bool lookup(const glm::dvec3& position, const glm::dvec3& normal, glm::dvec3& radiance) const;
+
+    // Number of diffuse reflections before paths are terminated in the cache
+    size_t termination_depth;
+
+private:
+    struct Cell
+    {
+        std::atomic_uint64_t key = 0; // 0 if unclaimed
+        std::array<AtomicDouble, 3> radiance;
+        std::atomic_uint32_t num_samples = 0;
+    };
+
+    uint64_t key(const glm::dvec3& position, const glm::dvec3& normal) const;
+    Cell* find(uint64_t key, bool claim) const;
+
+    std::unique_ptr<Cell[]> cells;
+    size_t size;
+
+    glm::dvec3 origin;
+    double inv_cell_size;
+    uint32_t min_samples;
+
+    const size_t max_probes = 8;
+};
@@ -0,0 +1,110 @@
+#include "animation.hpp"
+
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+#include "../common/util.hpp"
+
+namespace
+{
+    const std::vector<std::string> animated_properties = { "eye", "look_at", "forward", "up", "focal_length", "f_stop", "focus_distance" };
+
+    // Numbers or arrays of numbers
+    nlohmann::json lerp(const nlohmann::json &a, const nlohmann::json &b, double t)
+    {
+        if (a.is_array())
+        {
+            nlohmann::json result = nlohmann::json::array();
+            for (size_t i = 0; i < a.size(); i++)
+            {
+                result.push_back(lerp(a.at(i), b.at(i), t));
+            }
+            return result;
+        }
+        return a.get<double>() * (1.0 - t) + b.get<double>() * t;
+    }
+}
+
+size_t Animation::numFrames(const nlohmann::json &c)
+{
+    if (c.find("animation") == c.end())
+    {
+        return 1;
+    }
+
+    const nlohmann::json &a = c.at("animation");
+    size_t last_keyframe = 0;
+    for (const auto &k : a.at("keyframes"))
+    {
+        last_keyframe = std::max(last_keyframe, k.at("frame").get<size_t>());
+    }
+    return std::max(getOptional(a, "frames", last_keyframe + 1), size_t(1));
+}
+
+std::vector<nlohmann::json> Animation::frames(const nlohmann::json &c)
+{
+    if (c.find("animation") == c.end())
+    {
+        return { c };
+    }
+
+    std::vector<nlohmann::json> keyframes = c.at("animation").at("keyframes");
+    std::sort(keyframes.begin(), keyframes.end(), [](const nlohmann::json &a, const nlohmann::json &b)
+    {
+        return a.at("frame").get<size_t>() < b.at("frame").get<size_t>();
+    });
+
+    size_t num_frames = numFrames(c);
+    size_t digits = std::to_string(num_frames - 1).size();
+
+    std::vector<nlohmann::json> frames;
+    for (size_t frame = 0; frame < num_frames; frame++)
+    {
+        nlohmann::json f = c;
+        f.erase("animation");
+
+        for (const auto &property : animated_properties)
+        {
+            const nlohmann::json *before = nullptr, *after = nullptr;
+            size_t before_frame = 0, after_frame = 0;
+            for (const auto &k : keyframes)
+            {
+                if (k.find(property) == k.end()) continue;
+
+                size_t k_frame = k.at("frame");
+                if (k_frame <= frame)
+                {
+                    before = &k.at(property);
+                    before_frame = k_frame;
+                }
+                else if (!after)
+                {
+                    after = &k.at(property);
+                    after_frame = k_frame;
+                }
+            }
+
+            if (!before && !after) continue;
+
+            if (before && after)
+                f[property] = lerp(*before, *after, static_cast<double>(frame - before_frame) / (after_frame - before_frame));
+            else
+                f[property] = before ? *before : *after;
+
+            // The camera prefers look_at over forward and up
+            if (property == "forward" || property == "up")
+            {
+                f.erase("look_at");
+            }
+        }
+
+        std::stringstream ss;
+        ss << c.at("savename").get<std::string>() << "_" << std::setw(digits) << std::setfill('0') << frame;
+        f["savename"] = ss.str();
+
+        frames.push_back(f);
+    }
+    return frames;
+}
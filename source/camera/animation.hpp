@@ -0,0 +1,19 @@
+#pragma once
+
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+/*************************************************************************************
+Keyframe animation of cameras. Each property of the keyframes is linearly interpolated 
+between the keyframes that specify it, and is held constant before the first and after 
+the last of them. Properties that no keyframe specifies keep the value of the camera.
+**************************************************************************************/
+namespace Animation
+{
+    // Number of frames of the camera, 1 if it isn't animated
+    size_t numFrames(const nlohmann::json &c);
+
+    // One camera object per frame, with interpolated properties and the frame number appended to the savename
+    std::vector<nlohmann::json> frames(const nlohmann::json &c);
+}
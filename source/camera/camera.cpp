@@ -1,34 +1,49 @@
 #include "camera.hpp"
 
 #include <thread>
+#include <cmath>
 #include <algorithm>
+#include <numeric>
 #include <functional>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 
+#include <glm/gtx/component_wise.hpp>
+
 #include "../ray/ray.hpp"
 #include "../integrator/path-tracer/path-tracer.hpp"
 #include "../integrator/photon-mapper/photon-mapper.hpp"
+#include "../integrator/vcm/vcm.hpp"
+#include "../integrator/bdpt/bdpt.hpp"
+#include "../integrator/mlt/mlt.hpp"
 #include "../random/random.hpp"
 #include "../common/util.hpp"
 #include "../common/constexpr-math.hpp"
 #include "../common/format.hpp"
+#include "../common/thread-pool.hpp"
+#include "../common/thread-counters.hpp"
 
-Camera::Camera(const nlohmann::json &j, const Option &option)
+std::shared_ptr<Integrator> Camera::createIntegrator(const nlohmann::json &j, Option::IntegratorType type)
 {
-    if (option.photon_map)
-    {
-        integrator = std::make_shared<PhotonMapper>(j);
-    }
-    else
+    switch (type)
     {
-        integrator = std::make_shared<PathTracer>(j);
+        case Option::IntegratorType::PHOTON_MAPPER:
+            return std::make_shared<PhotonMapper>(j);
+        case Option::IntegratorType::BDPT:
+            return std::make_shared<BDPT>(j);
+        case Option::IntegratorType::VCM:
+            return std::make_shared<VCM>(j);
+        case Option::IntegratorType::MLT:
+            return std::make_shared<MLT>(j);
+        default:
+            return std::make_shared<PathTracer>(j);
     }
+}
 
-    const nlohmann::json &c = j.at("cameras").at(option.camera_idx);
-
-    image = Image(c.at("image"));
+Camera::Camera(const nlohmann::json &c, std::shared_ptr<Integrator> integrator) : integrator(integrator)
+{
+    image = Image(c.at("image"), integrator && integrator->numa);
     eye = c.at("eye");
     focal_length = c.at("focal_length").get<double>() / 1000.0;
     sensor_width = c.at("sensor_width").get<double>() / 1000.0;
@@ -36,6 +51,11 @@ Camera::Camera(const nlohmann::json &j, const Option &option)
     savename = c.at("savename");
     aperture_radius = (focal_length / getOptional(c, "f_stop", -1.0)) / 2.0;
     focus_distance = getOptional(c, "focus_distance", -1.0);
+    time_budget = getOptional(c, "time_budget", -1.0);
+
+    std::string order = getOptional<std::string>(c, "bucket_order", "SHUFFLE");
+    std::transform(order.begin(), order.end(), order.begin(), toupper);
+    bucket_order = order == "HILBERT" ? BucketOrder::HILBERT : order == "MORTON" ? BucketOrder::MORTON : BucketOrder::SHUFFLE;
 
     if (c.find("look_at") != c.end())
     {
@@ -54,47 +74,176 @@ Camera::Camera(const nlohmann::json &j, const Option &option)
     }
 
     thin_lens = aperture_radius > 0.0 && focus_distance > 0.0;
+
+    splat_image.resize(image.num_pixels);
 }
 
-void Camera::samplePixel(size_t x, size_t y)
+Ray Camera::generateRay(const glm::dvec2& pixel_space_pos) const
 {
-    auto& pixel = image(x, y);
-
     double pixel_size = sensor_width / image.width;
-    double sub_step = 1.0 / sqrtspp;
+    glm::dvec2 center_offset = pixel_size * (glm::dvec2(image.width, image.height) * 0.5 - pixel_space_pos);
+
+    glm::dvec3 sensor_pos = eye + forward * focal_length + left * center_offset.x + up * center_offset.y;
+
+    // Pinhole camera ray
+    Ray ray(eye, sensor_pos, integrator->scene.ior);
+
+    if (thin_lens)
+    {
+        // Thin lens camera ray for depth of field
+        glm::dvec3 focus_point = ray(focus_distance / glm::dot(ray.direction, forward));
+        glm::dvec2 aperture_sample = Random::uniformDiskSample() * aperture_radius;
+        ray.start += left * aperture_sample.x + up * aperture_sample.y;
+        ray.direction = glm::normalize(focus_point - ray.start);
+    }
+    return ray;
+}
+
+void Camera::samplePixelRays(size_t x, size_t y, std::vector<Ray>& rays) const
+{
+    double sub_step = 1.0 / pass_sqrtspp;
 
-    glm::dvec2 half_dim = glm::dvec2(image.width, image.height) * 0.5;
+    double pixel_estimate = pixel_estimates.empty() ? 0.0 : pixel_estimates[y * image.width + x];
 
-    for (int s_x = 0; s_x < sqrtspp; s_x++)
+    for (size_t s_x = 0; s_x < pass_sqrtspp; s_x++)
     {
-        for (int s_y = 0; s_y < sqrtspp; s_y++)
+        for (size_t s_y = 0; s_y < pass_sqrtspp; s_y++)
         {
             glm::dvec2 pixel_space_pos(x + s_x * sub_step + Random::get(0.0, sub_step), y + s_y * sub_step + Random::get(0.0, sub_step));
-            glm::dvec2 center_offset = pixel_size * (half_dim - pixel_space_pos);
 
-            glm::dvec3 sensor_pos = eye + forward * focal_length + left * center_offset.x + up * center_offset.y;
+            Ray ray = generateRay(pixel_space_pos);
+            ray.pixel_estimate = pixel_estimate;
+            ray.pixel = static_cast<int32_t>(y * image.width + x);
 
-            // Pinhole camera ray
-            Ray ray(eye, sensor_pos, integrator->scene.ior);
+            rays.push_back(ray);
+        }
+    }
+}
 
-            if (thin_lens)
+void Camera::sampleImage()
+{
+    std::future<void> done = startPass();
+    finishPass(done);
+}
+
+void Camera::saveImage()
+{
+    image.save(savename);
+
+    if (!float_writer) float_writer = image.createFloatWriter(savename);
+    if (float_writer)
+    {
+        float_writer->finish(image);
+        float_writer.reset();
+    }
+}
+
+std::future<void> Camera::startMainPass()
+{
+    pass = integrator->numTrainingPasses();
+    pass_sqrtspp = sqrtspp;
+
+    // Splatted radiance is only added to the pixels after the pass
+    if (!integrator->splatsToCamera())
+    {
+        float_writer = image.createFloatWriter(savename);
+    }
+    return startPass();
+}
+
+std::future<void> Camera::startPass()
+{
+    pass_counters = Counters::sum();
+    snapshots.clear();
+
+    ThreadPool& pool = ThreadPool::get();
+
+    pass_start = std::chrono::steady_clock::now();
+    bucket_queue.reset();
+    std::future<void> done;
+
+    if (integrator->samplesImage())
+    {
+        for (size_t i = 0; i < image.num_pixels; i++)
+        {
+            image(i % image.width, i / image.width) = glm::dvec3(0.0);
+        }
+        done = pool.submit([this]()
+        {
+            integrator->sampleImage(pow2(pass_sqrtspp));
+        });
+    }
+    else
+    {
+        // The order is kept between passes with NUMA, so that the queue starts each thread with the 
+        // buckets whose pixels it wrote first, which placed them on the node of the thread
+        if (!integrator->numa || pass_buckets.empty())
+        {
+            pass_buckets = buckets();
+        }
+
+        std::vector<uint32_t> bucket_indices(pass_buckets.size());
+        std::iota(bucket_indices.begin(), bucket_indices.end(), 0);
+        bucket_queue = std::make_unique<WorkQueue<uint32_t>>(bucket_indices, pool.size());
+
+        active_buckets = std::vector<ActiveBucket>(pool.size());
+        num_column_steals = 0;
+
+        bucket_pixels_left.reset();
+        if (float_writer)
+        {
+            bucket_pixels_left = std::make_unique<std::atomic<uint32_t>[]>(pass_buckets.size());
+            for (size_t i = 0; i < pass_buckets.size(); i++)
             {
-                // Thin lens camera ray for depth of field
-                glm::dvec3 focus_point = ray(focus_distance / glm::dot(ray.direction, forward));
-                glm::dvec2 aperture_sample = Random::uniformDiskSample() * aperture_radius;
-                ray.start += left * aperture_sample.x + up * aperture_sample.y;
-                ray.direction = glm::normalize(focus_point - ray.start);
+                glm::ivec2 size = pass_buckets[i].max - pass_buckets[i].min;
+                bucket_pixels_left[i] = size.x * size.y;
             }
+        }
+
+        auto sampleThread = [this](size_t worker)
+        {
+            sampleImageThread(*bucket_queue, worker);
+        };
+        done = integrator->numa ? pool.forEachThread(sampleThread) : pool.forEachWorker(sampleThread);
+    }
+    return done;
+}
 
-            pixel += integrator->sampleRay(ray);
+void Camera::finishPass(std::future<void>& done)
+{
+    printInfo(done);
+    ThreadPool::get().wait(done);
+
+    if (bucket_queue)
+    {
+        bucket_stats = bucket_queue->stats();
+
+        // The queue only knows when workers ran out of buckets, not when they ran out of columns to steal
+        auto last_finish = std::max_element(active_buckets.begin(), active_buckets.end(), 
+            [](const ActiveBucket& a, const ActiveBucket& b) { return a.finish < b.finish; })->finish;
+        double idle = 0.0, total = std::chrono::duration<double>(last_finish - pass_start).count() * active_buckets.size();
+        for (const auto& active : active_buckets)
+        {
+            idle += std::chrono::duration<double>(last_finish - active.finish).count();
+        }
+        bucket_stats.idle_fraction = total > 0.0 ? idle / total : 0.0;
+    }
+
+    double spp = pow2(static_cast<double>(pass_sqrtspp));
+    for (size_t y = 0; y < image.height; y++)
+    {
+        for (size_t x = 0; x < image.width; x++)
+        {
+            auto& s = splat_image[y * image.width + x];
+            image(x, y) += glm::dvec3(s[0], s[1], s[2]) / spp;
+            s = { 0.0, 0.0, 0.0 };
         }
     }
-    pixel /= pow2(sqrtspp);
-    num_sampled_pixels++;
 }
 
-void Camera::sampleImage()
+std::vector<Camera::Bucket> Camera::buckets() const
 {
+    // Buckets of a crop are those of the whole image clipped to the crop
     std::vector<Bucket> buckets_vec;
     for (size_t x = 0; x < image.width; x += bucket_size)
     {
@@ -104,48 +253,371 @@ void Camera::sampleImage()
         {
             size_t y_end = y + bucket_size;
             if (y_end >= image.height) y_end = image.height;
-            buckets_vec.push_back(Bucket(glm::ivec2(x, y), glm::ivec2(x_end, y_end)));
+
+            Bucket bucket(glm::max(glm::ivec2(x, y), image.crop_min), glm::min(glm::ivec2(x_end, y_end), image.crop_max));
+            if (bucket.min.x < bucket.max.x && bucket.min.y < bucket.max.y)
+            {
+                buckets_vec.push_back(bucket);
+            }
         }
     }
 
-    std::shuffle(buckets_vec.begin(), buckets_vec.end(), Random::engine);
-    WorkQueue<Bucket> buckets(buckets_vec);
-    buckets_vec.clear();
+    orderBuckets(buckets_vec);
+    return buckets_vec;
+}
 
-    std::function<void(Camera*, WorkQueue<Bucket>&)> f = &Camera::sampleImageThread;
+void Camera::sampleBuckets(const std::vector<Bucket>& buckets)
+{
+    integrator->camera = this;
+    pass = integrator->numTrainingPasses();
+    pass_sqrtspp = sqrtspp;
+    pass_buckets = buckets;
+    bucket_pixels_left.reset();
+
+    ThreadPool& pool = ThreadPool::get();
+
+    std::vector<uint32_t> bucket_indices(pass_buckets.size());
+    std::iota(bucket_indices.begin(), bucket_indices.end(), 0);
+    bucket_queue = std::make_unique<WorkQueue<uint32_t>>(bucket_indices, pool.size());
+    active_buckets = std::vector<ActiveBucket>(pool.size());
+
+    pool.run([this](size_t worker)
+    {
+        sampleImageThread(*bucket_queue, worker);
+    });
+}
+
+/*************************************************************************************
+Shuffled buckets make the progress estimate even over the image. Buckets ordered along
+a Hilbert or Morton curve are close to the buckets before and after them, and the work
+queue gives each thread a contiguous run of them, so consecutive buckets of a thread
+share more BVH nodes and photon map octants in the caches.
+**************************************************************************************/
+void Camera::orderBuckets(std::vector<Bucket>& buckets) const
+{
+    if (bucket_order == BucketOrder::SHUFFLE)
+    {
+        std::shuffle(buckets.begin(), buckets.end(), Random::engine);
+        return;
+    }
 
-    std::vector<std::unique_ptr<std::thread>> threads(integrator->num_threads);
-    for (auto& thread : threads)
+    size_t grid_size = 1;
+    while (grid_size * bucket_size < std::max(image.width, image.height))
     {
-        thread = std::make_unique<std::thread>(f, this, std::ref(buckets));
+        grid_size *= 2;
     }
 
-    std::function<void(Camera*, WorkQueue<Bucket>&)> p = &Camera::printInfoThread;
-    std::thread print_thread(p, this, std::ref(buckets));
+    auto morton = [](uint32_t x, uint32_t y)
+    {
+        uint64_t d = 0;
+        for (uint32_t b = 0; b < 32; b++)
+        {
+            d |= (uint64_t((x >> b) & 1) << (2 * b)) | (uint64_t((y >> b) & 1) << (2 * b + 1));
+        }
+        return d;
+    };
+
+    auto hilbert = [grid_size](uint32_t x, uint32_t y)
+    {
+        uint64_t d = 0;
+        for (uint32_t s = static_cast<uint32_t>(grid_size / 2); s > 0; s /= 2)
+        {
+            uint32_t rx = (x & s) > 0;
+            uint32_t ry = (y & s) > 0;
+            d += uint64_t(s) * s * ((3 * rx) ^ ry);
 
-    print_thread.join();
+            // Rotate the quadrant
+            if (ry == 0)
+            {
+                if (rx == 1)
+                {
+                    x = s - 1 - x;
+                    y = s - 1 - y;
+                }
+                std::swap(x, y);
+            }
+        }
+        return d;
+    };
 
-    for (auto& thread : threads)
+    auto key = [&](const Bucket& b)
     {
-        thread->join();
+        uint32_t x = static_cast<uint32_t>(b.min.x / bucket_size), y = static_cast<uint32_t>(b.min.y / bucket_size);
+        return bucket_order == BucketOrder::HILBERT ? hilbert(x, y) : morton(x, y);
+    };
+
+    std::sort(buckets.begin(), buckets.end(), [&](const Bucket& a, const Bucket& b) { return key(a) < key(b); });
+}
+
+/*************************************************************************************
+Buckets are sampled one column at a time, and each worker publishes the remaining 
+columns of its bucket. Workers that find no buckets left in the queue steal the back 
+half of the remaining columns of the worker with the most of them, so that expensive 
+buckets at the end of a pass are split between all workers. Each pixel is seeded 
+separately if deterministic, which makes the samples independent of the splitting,
+the bucket layout and the crop.
+**************************************************************************************/
+void Camera::sampleImageThread(WorkQueue<uint32_t>& buckets, size_t worker)
+{
+    size_t spp = pow2(pass_sqrtspp);
+    uint64_t pass_seed = Random::hash(integrator->seed, pass);
+
+    Counters::Thread& counters = Counters::local();
+
+    // Buffers reused for all batches of the thread
+    std::vector<Ray> rays;
+    std::vector<glm::dvec3> radiance;
+    std::vector<glm::ivec2> pixels;
+    std::vector<uint32_t> pixel_buckets;
+
+    ActiveBucket& active = active_buckets[worker];
+
+    auto sampleBatch = [&]()
+    {
+        uint64_t rays_before = counters.rays.load(std::memory_order_relaxed);
+        uint64_t shadow_rays_before = counters.shadow_rays.load(std::memory_order_relaxed);
+
+        radiance.resize(rays.size());
+        integrator->sampleRays(rays, radiance);
+
+        Counters::add(active.counters.pixels, pixels.size());
+        Counters::add(active.counters.samples, rays.size());
+        Counters::add(active.counters.rays, counters.rays.load(std::memory_order_relaxed) - rays_before);
+        Counters::add(active.counters.shadow_rays, counters.shadow_rays.load(std::memory_order_relaxed) - shadow_rays_before);
+
+        for (size_t i = 0; i < pixels.size(); i++)
+        {
+            glm::dvec3 pixel(0.0);
+            for (size_t s = i * spp; s < (i + 1) * spp; s++)
+            {
+                pixel += radiance[s];
+            }
+            image(pixels[i].x, pixels[i].y) = pixel / static_cast<double>(spp);
+        }
+        Counters::add(counters.pixels, pixels.size());
+        Counters::add(counters.samples, rays.size());
+
+        // Pixels of the same bucket are consecutive, so the counters are updated once per run of them
+        if (bucket_pixels_left)
+        {
+            for (size_t i = 0; i < pixel_buckets.size(); )
+            {
+                uint32_t bucket_idx = pixel_buckets[i];
+                uint32_t n = 0;
+                for (; i < pixel_buckets.size() && pixel_buckets[i] == bucket_idx; i++) n++;
+
+                if (bucket_pixels_left[bucket_idx].fetch_sub(n) == n)
+                {
+                    float_writer->write(image, pass_buckets[bucket_idx].min, pass_buckets[bucket_idx].max);
+                }
+            }
+        }
+
+        rays.clear();
+        pixels.clear();
+        pixel_buckets.clear();
+    };
+
+    while (true)
+    {
+        uint32_t bucket_idx;
+        if (buckets.getWork(worker, bucket_idx))
+        {
+            const Bucket& bucket = pass_buckets[bucket_idx];
+            active.columns = packColumns(bucket_idx, 0, bucket.max.x - bucket.min.x);
+        }
+        else if (!stealColumns(worker))
+        {
+            break;
+        }
+
+        uint32_t column;
+        while (claimColumn(active, bucket_idx, column))
+        {
+            const Bucket& bucket = pass_buckets[bucket_idx];
+            size_t x = bucket.min.x + column;
+
+            for (size_t y = bucket.min.y; y < size_t(bucket.max.y); y++)
+            {
+                if (!rays.empty() && rays.size() + spp > max_batch_size)
+                {
+                    sampleBatch();
+                }
+
+                if (integrator->deterministic)
+                {
+                    Random::seed(pass_seed, y * image.width + x);
+                }
+
+                samplePixelRays(x, y, rays);
+                pixels.emplace_back(x, y);
+                pixel_buckets.push_back(bucket_idx);
+
+                // Batches may not span pixels if the random numbers must only depend on the pixel
+                if (integrator->deterministic)
+                {
+                    sampleBatch();
+                }
+            }
+        }
+        sampleBatch();
+    }
+
+    active.finish = std::chrono::steady_clock::now();
+
+    // The first worker that runs out of work queues the main pass of the next camera behind this one
+    Camera* next = next_camera.load(std::memory_order_acquire);
+    if (next && !next_camera_started.exchange(true))
+    {
+        next->prepareIntegrator();
+        next->started_pass = next->startMainPass();
+    }
+}
+
+uint64_t Camera::packColumns(uint32_t bucket_idx, uint32_t begin, uint32_t end)
+{
+    return (uint64_t(bucket_idx) << 32) | (uint64_t(begin) << 16) | end;
+}
+
+void Camera::unpackColumns(uint64_t columns, uint32_t& bucket_idx, uint32_t& begin, uint32_t& end)
+{
+    bucket_idx = static_cast<uint32_t>(columns >> 32);
+    begin = static_cast<uint32_t>((columns >> 16) & 0xFFFF);
+    end = static_cast<uint32_t>(columns & 0xFFFF);
+}
+
+bool Camera::claimColumn(ActiveBucket& active, uint32_t& bucket_idx, uint32_t& column)
+{
+    uint64_t columns = active.columns;
+    uint32_t begin, end;
+    do
+    {
+        unpackColumns(columns, bucket_idx, begin, end);
+        if (begin >= end) return false;
+    } while (!active.columns.compare_exchange_weak(columns, packColumns(bucket_idx, begin + 1, end)));
+
+    column = begin;
+    return true;
+}
+
+bool Camera::stealColumns(size_t worker)
+{
+    while (true)
+    {
+        // Victim with the most columns that its owner has not claimed yet. At least two are needed, so that
+        // the owner keeps half of them after the steal.
+        size_t victim = worker;
+        uint32_t max_remaining = 1;
+        for (size_t w = 0; w < active_buckets.size(); w++)
+        {
+            uint32_t bucket_idx, begin, end;
+            unpackColumns(active_buckets[w].columns, bucket_idx, begin, end);
+            if (w != worker && begin < end && end - begin > max_remaining)
+            {
+                victim = w;
+                max_remaining = end - begin;
+            }
+        }
+
+        if (victim == worker) return false;
+
+        uint64_t columns = active_buckets[victim].columns;
+        uint32_t bucket_idx, begin, end;
+        unpackColumns(columns, bucket_idx, begin, end);
+        if (begin >= end || end - begin < 2) continue;
+
+        uint32_t half = (end - begin) / 2;
+        if (active_buckets[victim].columns.compare_exchange_strong(columns, packColumns(bucket_idx, begin, end - half)))
+        {
+            active_buckets[worker].columns = packColumns(bucket_idx, end - half, end);
+            num_column_steals++;
+            return true;
+        }
     }
 }
 
-void Camera::sampleImageThread(WorkQueue<Bucket>& buckets)
+void Camera::updatePixelEstimates()
 {
-    Bucket bucket;
-    while (buckets.getWork(bucket))
+    pixel_estimates.assign(image.num_pixels, 0.0);
+
+    // 3x3 box filter to reduce the noise of the low sample count estimate
+    for (int y = 0; y < int(image.height); y++)
     {
-        for (size_t x = bucket.min.x; x < bucket.max.x; x++)
+        for (int x = 0; x < int(image.width); x++)
         {
-            for (size_t y = bucket.min.y; y < bucket.max.y; y++)
+            double sum = 0.0;
+            size_t count = 0;
+            for (int v = std::max(y - 1, 0); v <= std::min(y + 1, int(image.height) - 1); v++)
             {
-                samplePixel(x, y);
+                for (int u = std::max(x - 1, 0); u <= std::min(x + 1, int(image.width) - 1); u++)
+                {
+                    sum += glm::compAdd(image(u, v)) / 3.0;
+                    count++;
+                }
             }
+            pixel_estimates[y * image.width + x] = sum / count;
         }
     }
 }
 
+bool Camera::connect(const glm::dvec3& p, Connection& connection) const
+{
+    connection.position = eye;
+    if (thin_lens)
+    {
+        glm::dvec2 aperture_sample = Random::uniformDiskSample() * aperture_radius;
+        connection.position += left * aperture_sample.x + up * aperture_sample.y;
+    }
+
+    glm::dvec3 direction = glm::normalize(p - connection.position);
+    double cos_theta = glm::dot(direction, forward);
+    if (cos_theta <= 0.0) return false;
+
+    // Direction of the pinhole ray through the same point on the focus plane
+    glm::dvec3 sensor_direction = direction;
+    if (thin_lens)
+    {
+        glm::dvec3 focus_point = connection.position + direction * (focus_distance / cos_theta);
+        sensor_direction = glm::normalize(focus_point - eye);
+    }
+
+    glm::dvec3 sensor_offset = sensor_direction * (focal_length / glm::dot(sensor_direction, forward)) - forward * focal_length;
+    glm::dvec2 center_offset(glm::dot(sensor_offset, left), glm::dot(sensor_offset, up));
+
+    double pixel_size = sensor_width / image.width;
+    glm::dvec2 pixel_space_pos = glm::dvec2(image.width, image.height) * 0.5 - center_offset / pixel_size;
+
+    if (pixel_space_pos.x < 0.0 || pixel_space_pos.y < 0.0 || pixel_space_pos.x >= image.width || pixel_space_pos.y >= image.height)
+    {
+        return false;
+    }
+
+    connection.pixel = glm::ivec2(pixel_space_pos);
+    connection.pdf = directionPdf(direction);
+    return true;
+}
+
+/**********************************************************************************
+Pixel positions are sampled uniformly, so the pdf per unit image plane area is 1 if
+areas are measured in pixels. The image plane is at distance d in pixels, and the 
+solid angle pdf is obtained by multiplying with d^2 / cos^3. The same applies to thin
+lens rays since their directions are also determined by the point on the focus plane.
+***********************************************************************************/
+double Camera::directionPdf(const glm::dvec3& direction) const
+{
+    double image_plane_distance = focal_length * image.width / sensor_width;
+    return pow2(image_plane_distance) / std::pow(glm::dot(direction, forward), 3.0);
+}
+
+void Camera::splat(const glm::ivec2& pixel, const glm::dvec3& radiance)
+{
+    auto& s = splat_image[pixel.y * image.width + pixel.x];
+    for (uint8_t c = 0; c < 3; c++)
+    {
+        s[c].add(radiance[c]);
+    }
+}
+
 void Camera::lookAt(const glm::dvec3& p)
 {
     forward = glm::normalize(p - eye);
@@ -153,22 +625,128 @@ void Camera::lookAt(const glm::dvec3& p)
     up = glm::normalize(glm::cross(forward, left));
 }
 
-void Camera::capture()
+void Camera::waitForStartedPass()
+{
+    if (started_pass.valid())
+    {
+        ThreadPool::get().wait(started_pass);
+    }
+}
+
+void Camera::prepareIntegrator()
 {
+    integrator->camera = this;
+    integrator->allocatePixelData(image.width, image.height);
+}
+
+void Camera::capture(Camera* next)
+{
+    auto capture_start = std::chrono::steady_clock::now();
+
+    // A main pass started by the previous camera is already set up and read by its workers, and the 
+    // integrator then has no training passes and the camera no time budget
+    if (!started_pass.valid())
+    {
+        prepareIntegrator();
+
+        size_t num_training_passes = integrator->numTrainingPasses();
+        if (num_training_passes)
+        {
+            std::cout << std::endl << std::string(29, '-') << "| TRAINING PASSES |" << std::string(30, '-') << std::endl << std::endl;
+            auto before = std::chrono::system_clock::now();
+            for (pass = 0; pass < num_training_passes; pass++)
+            {
+                // Quadruple the number of samples each pass since later passes learn from more refined data
+                pass_sqrtspp = std::min(sqrtspp, size_t(1) << pass);
+                std::cout << "\r" + std::string(100, ' ') + "\r";
+                std::cout << "Pass " << pass + 1 << "/" << num_training_passes << ", samples per pixel: " << pow2(pass_sqrtspp) << std::endl;
+                sampleImage();
+                integrator->trainingPassDone();
+                if (integrator->adjoint_rr) updatePixelEstimates();
+            }
+            auto now = std::chrono::system_clock::now();
+            std::cout << "\r" + std::string(100, ' ') + "\r";
+            std::cout << "Training completed in " << Format::timeDuration(std::chrono::duration_cast<std::chrono::milliseconds>(now - before).count()) << std::endl;
+        }
+
+        pass = num_training_passes;
+
+        // Samples per pixel that fit in the remaining time, estimated from a pass with one sample per pixel
+        if (time_budget > 0.0)
+        {
+            pass_sqrtspp = 1;
+            std::cout << std::endl << "Pilot pass for the time budget of " << Format::timeDuration(static_cast<size_t>(time_budget * 1000.0)) << std::endl;
+            auto pilot_start = std::chrono::steady_clock::now();
+            sampleImage();
+            auto now = std::chrono::steady_clock::now();
+            double pilot = std::chrono::duration<double>(now - pilot_start).count();
+            double remaining = time_budget - std::chrono::duration<double>(now - capture_start).count();
+            sqrtspp = std::max(static_cast<size_t>(std::sqrt(std::max(remaining, 0.0) / pilot)), size_t(1));
+            std::cout << "\r" + std::string(100, ' ') + "\r";
+        }
+
+        pass_sqrtspp = sqrtspp;
+    }
+
     std::cout << std::endl << std::string(28, '-') << "| MAIN RENDERING PASS |" << std::string(28, '-') << std::endl;
     std::cout << std::endl << "Samples per pixel: " << pow2(static_cast<double>(sqrtspp)) << std::endl << std::endl;
-    auto before = std::chrono::system_clock::now();
-    sampleImage();
+
+    // Set before the pass starts, so that its workers see it. If the previous camera already started the
+    // pass, workers that finished before this don't start the next camera, which then starts its own pass.
+    next_camera_started = false;
+    next_camera.store(next && integrator->rendersConcurrentCameras() && next->time_budget <= 0.0 ? next : nullptr, std::memory_order_release);
+    std::future<void> done = started_pass.valid() ? std::move(started_pass) : startMainPass();
+    finishPass(done);
+    next_camera = nullptr;
+
     saveImage();
     auto now = std::chrono::system_clock::now();
     std::cout << "\r" + std::string(100, ' ') + "\r";
     std::cout << "Render Completed: " << Format::date(now);
-    std::cout << ", Elapsed Time: " << Format::timeDuration(std::chrono::duration_cast<std::chrono::milliseconds>(now - before).count()) << std::endl;
+    std::cout << ", Elapsed Time: " << Format::timeDuration(std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - pass_start).count()) << std::endl;
+    Counters::Totals totals = passTotals();
+    std::cout << "Samples: " << Format::largeNumber(totals.samples)
+              << ", Rays: " << Format::largeNumber(totals.rays)
+              << ", Shadow rays: " << Format::largeNumber(totals.shadow_rays) << std::endl;
+
+    if (!integrator->samplesImage())
+    {
+        std::cout << "Buckets stolen: " << bucket_stats.steals << ", Bucket splits: " << num_column_steals << ", Thread idle time: " << Format::progress(100.0 * bucket_stats.idle_fraction) << std::endl;
+    }
+}
+
+size_t Camera::numSampledPixels() const
+{
+    // Integrators that sample the image themselves sample all of it, also when it is cropped
+    return integrator->samplesImage() ? image.num_pixels : image.numCropPixels();
 }
 
-void Camera::printInfoThread(WorkQueue<Bucket>& buckets)
+Counters::Totals Camera::passTotals() const
 {
-    auto printProgressInfo = [](double progress, size_t msec_duration, size_t sps, std::ostream& out)
+    Counters::Totals totals;
+    if (!bucket_queue)
+    {
+        totals = Counters::sum();
+        totals.pixels -= pass_counters.pixels;
+        totals.samples -= pass_counters.samples;
+        totals.rays -= pass_counters.rays;
+        totals.shadow_rays -= pass_counters.shadow_rays;
+        return totals;
+    }
+
+    for (const auto& active : active_buckets)
+    {
+        totals.pixels += active.counters.pixels.load(std::memory_order_relaxed);
+        totals.samples += active.counters.samples.load(std::memory_order_relaxed);
+        totals.rays += active.counters.rays.load(std::memory_order_relaxed);
+        totals.shadow_rays += active.counters.shadow_rays.load(std::memory_order_relaxed);
+    }
+    return totals;
+}
+
+void Camera::printInfo(const std::future<void>& done)
+{
+    auto printProgressInfo = [](double progress, size_t msec_duration, size_t sps, size_t rps, std::ostream& out)
     {
         auto ETA = std::chrono::system_clock::now() + std::chrono::milliseconds(msec_duration);
 
@@ -176,37 +754,43 @@ void Camera::printInfoThread(WorkQueue<Bucket>& buckets)
         ss << "\rTime remaining: " << Format::timeDuration(msec_duration)
            << " || " << Format::progress(progress)
            << " || ETA: " << Format::date(ETA)
-           << " || Samples/s: " << Format::largeNumber(sps) + "    ";
+           << " || Samples/s: " << Format::largeNumber(sps)
+           << " || Rays/s: " << Format::largeNumber(rps) + "    ";
 
         out << ss.str();
     };
 
-    while (!buckets.empty())
+    snapshots.emplace_back(std::chrono::steady_clock::now(), Counters::Totals());
+
+    size_t num_pass_pixels = numSampledPixels();
+
+    while (done.wait_for(std::chrono::milliseconds(1000)) != std::future_status::ready)
     {
-        if (num_sampled_pixels != last_num_sampled_pixels)
+        Counters::Totals totals = passTotals();
+        if (totals.pixels == snapshots.back().second.pixels)
         {
-            size_t delta_pixels = num_sampled_pixels - last_num_sampled_pixels;
-            size_t pixels_left = image.num_pixels - num_sampled_pixels;
-
-            auto now = std::chrono::steady_clock::now();
-            auto delta_t = std::chrono::duration_cast<std::chrono::milliseconds>(now - last_update);
+            continue;
+        }
 
-            times.push_back(static_cast<double>(delta_pixels) / delta_t.count());
-            if (times.size() > num_times)
-                times.pop_front();
+        snapshots.emplace_back(std::chrono::steady_clock::now(), totals);
+        if (snapshots.size() > num_snapshots)
+        {
+            snapshots.pop_front();
+        }
 
-            // moving average
-            double pixels_per_msec = std::accumulate(times.begin(), times.end(), 0.0) / times.size();
+        // Moving average over the snapshots
+        const auto& [first_time, first] = snapshots.front();
+        double seconds = std::chrono::duration<double>(snapshots.back().first - first_time).count();
 
-            double progress = 100.0 * static_cast<double>(num_sampled_pixels) / image.num_pixels;
-            size_t msec_left = static_cast<size_t>(pixels_left / pixels_per_msec);
-            size_t sps = static_cast<size_t>(pixels_per_msec * 1000.0 * pow2(static_cast<double>(sqrtspp)));
+        double pixels_per_sec = (totals.pixels - first.pixels) / seconds;
+        size_t sps = static_cast<size_t>((totals.samples - first.samples) / seconds);
+        size_t rps = static_cast<size_t>((totals.rays - first.rays) / seconds);
 
-            printProgressInfo(progress, msec_left, sps, std::cout);
+        size_t num_sampled_pixels = totals.pixels;
+        double progress = 100.0 * static_cast<double>(num_sampled_pixels) / num_pass_pixels;
+        size_t msec_left = static_cast<size_t>(1000.0 * (num_pass_pixels - num_sampled_pixels) / pixels_per_sec);
 
-            last_update = now;
-            last_num_sampled_pixels = num_sampled_pixels;
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+        printProgressInfo(progress, msec_left, sps, rps, std::cout);
+        if (progress_callback) progress_callback(progress);
     }
-}
\ No newline at end of file
+}
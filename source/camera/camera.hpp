@@ -3,6 +3,10 @@
 #include <chrono>
 #include <deque>
 #include <atomic>
+#include <vector>
+#include <array>
+#include <future>
+#include <functional>
 
 #include <glm/vec3.hpp>
 #include <glm/vec2.hpp>
@@ -14,21 +18,33 @@
 #include "../scene/scene.hpp"
 #include "../common/work-queue.hpp"
 #include "../common/option.hpp"
+#include "../common/atomic-double.hpp"
+#include "../common/thread-counters.hpp"
 
 class Integrator;
 
 class Camera
 {
 public:
-    Camera(const nlohmann::json &j, const Option &option);
+    // Creates the integrator and the scene, which can be shared by all cameras of the scene
+    static std::shared_ptr<Integrator> createIntegrator(const nlohmann::json &j, Option::IntegratorType type);
 
-    void capture();
+    // c is one of the cameras of the scene that the integrator was created from. Without an integrator, the
+    // camera can only be used for its image and buckets.
+    Camera(const nlohmann::json &c, std::shared_ptr<Integrator> integrator);
+
+    // If next is given and the integrator allows cameras to render concurrently, the main pass of next 
+    // is queued before waiting for this one, so that threads that run out of work continue with next. 
+    // next->capture() must then be called after this returns.
+    void capture(Camera* next = nullptr);
     void sampleImage();
 
-    void saveImage() const
-    {
-        image.save(savename);
-    }
+    // Waits for a main pass that the previous camera started, which must be done before this camera is 
+    // destroyed without being captured
+    void waitForStartedPass();
+
+    // Also completes the float image if the image has a float format
+    void saveImage();
 
     void setPosition(const glm::dvec3& p)
     {
@@ -37,8 +53,42 @@ public:
 
     void lookAt(const glm::dvec3& p);
 
+    // Connection of a scene point to a sampled point on the lens, used to trace paths from lights to the camera
+    struct Connection
+    {
+        glm::dvec3 position; // point on the lens
+        glm::ivec2 pixel;
+        double pdf;          // solid angle pdf at the lens of sampling the direction to the scene point
+    };
+
+    // Returns false if p is outside of the image
+    bool connect(const glm::dvec3& p, Connection& connection) const;
+
+    // Solid angle pdf of primary ray directions, with image plane areas measured in pixels
+    double directionPdf(const glm::dvec3& direction) const;
+
+    // Primary ray through a position on the image plane measured in pixels
+    Ray generateRay(const glm::dvec2& pixel_space_pos) const;
+
+    // Thread safe. Splatted radiance is added to the image after each pass, divided by the samples per pixel.
+    void splat(const glm::ivec2& pixel, const glm::dvec3& radiance);
+
+    // Pixels that are sampled once per sample index, which is also the number of light paths per sample index
+    // that integrators connect to the camera. Only the crop is sampled, unless the integrator samples the image
+    // itself, so that crops add up to the full image.
+    size_t numSampledPixels() const;
+
+    // Index of the pass being rendered, the training passes come first
+    size_t currentPass() const
+    {
+        return pass;
+    }
+
     size_t sqrtspp;
 
+    // Seconds that the camera may take to capture, sqrtspp is then chosen after a pilot pass if positive
+    double time_budget;
+
     glm::dvec3 eye;
     glm::dvec3 forward, left, up;
 
@@ -48,7 +98,9 @@ public:
 
     std::string savename;
 
-private:
+    // Called with the progress in percent of each pass whenever it is printed
+    std::function<void(double)> progress_callback;
+
     struct Bucket
     {
         Bucket() : min(0), max(0) { }
@@ -58,18 +110,96 @@ private:
         glm::ivec2 max;
     };
 
-    void samplePixel(size_t x, size_t y);
-    void sampleImageThread(WorkQueue<Bucket>& buckets);
+    // Buckets of a pass in rendering order
+    std::vector<Bucket> buckets() const;
+
+    // Renders only the buckets, with the settings of the main pass and without printing progress. Used when the
+    // buckets of the image are distributed between processes. The integrator must allow concurrent cameras.
+    void sampleBuckets(const std::vector<Bucket>& buckets);
 
-    void printInfoThread(WorkQueue<Bucket>& buckets);
+private:
+    enum class BucketOrder
+    {
+        SHUFFLE,
+        HILBERT,
+        MORTON
+    };
+
+    void orderBuckets(std::vector<Bucket>& buckets) const;
+
+    // Appends the primary rays of all samples of the pixel to rays
+    void samplePixelRays(size_t x, size_t y, std::vector<Ray>& rays) const;
+    void updatePixelEstimates();
+    // Remaining columns of the bucket that a worker is sampling, packed as bucket index, first and end column
+    struct alignas(64) ActiveBucket
+    {
+        std::atomic<uint64_t> columns = 0;
+        std::chrono::steady_clock::time_point finish;
+
+        // Work of the worker in this pass, which the global counters mix with the pass of the next camera
+        Counters::Thread counters;
+    };
+
+    static uint64_t packColumns(uint32_t bucket_idx, uint32_t begin, uint32_t end);
+    static void unpackColumns(uint64_t columns, uint32_t& bucket_idx, uint32_t& begin, uint32_t& end);
+    static bool claimColumn(ActiveBucket& active, uint32_t& bucket_idx, uint32_t& column);
+    bool stealColumns(size_t worker);
+
+    void sampleImageThread(WorkQueue<uint32_t>& buckets, size_t worker);
+
+    // sampleImage in two steps, the returned future is ready when all samples of the pass are taken
+    std::future<void> startPass();
+    std::future<void> startMainPass();
+    void finishPass(std::future<void>& done);
+
+    // Points the integrator to this camera, which capture skips if the previous camera started the main pass
+    void prepareIntegrator();
+
+    // Main pass started by the previous camera, and the camera whose main pass this camera starts
+    std::future<void> started_pass;
+    std::atomic<Camera*> next_camera = nullptr;
+    std::atomic_bool next_camera_started = false;
+
+    // Prints the progress of the pass until it is done
+    void printInfo(const std::future<void>& done);
 
     const size_t bucket_size = 32;
+    BucketOrder bucket_order;
+
+    // Maximum number of primary rays passed to the integrator at once, unless a pixel has more samples
+    const size_t max_batch_size = 4096;
+
+    // Pass currently being rendered, the final pass uses sqrtspp
+    size_t pass = 0, pass_sqrtspp = 0;
+
+    std::vector<std::array<AtomicDouble, 3>> splat_image;
+
+    std::vector<Bucket> pass_buckets;
+
+    // Tiles of the float image are written during the main pass as its buckets are done, if the pixels
+    // are final then. The pixels of each bucket that have not been written to the image are counted.
+    std::unique_ptr<FloatImageWriter> float_writer;
+    std::unique_ptr<std::atomic<uint32_t>[]> bucket_pixels_left;
+
+    std::vector<ActiveBucket> active_buckets;
+    std::unique_ptr<WorkQueue<uint32_t>> bucket_queue;
+
+    // Work stealing statistics of the last pass
+    WorkQueue<uint32_t>::Stats bucket_stats;
+    std::atomic_size_t num_column_steals = 0;
+    std::chrono::steady_clock::time_point pass_start;
+
+    // Luminance estimates of the previous pass, used by adjoint-driven russian roulette
+    std::vector<double> pixel_estimates;
 
     std::shared_ptr<Integrator> integrator;
 
-    std::atomic_size_t num_sampled_pixels = 0;
-    size_t last_num_sampled_pixels = 0;
-    std::chrono::time_point<std::chrono::steady_clock> last_update = std::chrono::steady_clock::now();
-    const size_t num_times = 32;
-    std::deque<double> times;
+    // Counters of all threads when the pass started, and the recent snapshots used for throughput averages
+    Counters::Totals pass_counters;
+
+    // Work of this pass so far. Bucket passes count their own work, since they can overlap with the next camera.
+    Counters::Totals passTotals() const;
+
+    const size_t num_snapshots = 32;
+    std::deque<std::pair<std::chrono::steady_clock::time_point, Counters::Totals>> snapshots;
 };
@@ -0,0 +1,218 @@
+#include "float-image-writer.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#include <glm/common.hpp>
+
+#include "image.hpp"
+
+namespace
+{
+    template <class T>
+    void put(std::ofstream& out, const T& value)
+    {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    void putString(std::ofstream& out, const std::string& s)
+    {
+        out.write(s.c_str(), s.size() + 1);
+    }
+
+    void putAttribute(std::ofstream& out, const std::string& name, const std::string& type, uint32_t size)
+    {
+        putString(out, name);
+        putString(out, type);
+        put(out, size);
+    }
+}
+
+FloatImageWriter::FloatImageWriter(const std::string& filename, Format format, const glm::ivec2& image_size,
+                                   const glm::ivec2& min, const glm::ivec2& max)
+    : format(format), min(min), max(max)
+{
+    glm::ivec2 size = max - min;
+    num_tiles = (size + tile_size - 1) / tile_size;
+    remaining_pixels.resize(static_cast<size_t>(num_tiles.x) * num_tiles.y);
+    for (int ty = 0; ty < num_tiles.y; ty++)
+    {
+        for (int tx = 0; tx < num_tiles.x; tx++)
+        {
+            glm::ivec2 tile_size_clipped = glm::min(glm::ivec2(tile_size), size - glm::ivec2(tx, ty) * tile_size);
+            remaining_pixels[ty * num_tiles.x + tx] = tile_size_clipped.x * tile_size_clipped.y;
+        }
+    }
+
+    if (format == Format::PFM)
+    {
+        file.open(filename + ".pfm", std::ios::binary);
+
+        // A negative scale means little endian. Rows are stored from the bottom up.
+        file << "PF\n" << size.x << " " << size.y << "\n-1.0\n";
+        pfm_pixels_start = file.tellp();
+
+        // Tiles are written at their positions in the file, which must then exist
+        std::vector<char> zeros(size_t(size.x) * 3 * sizeof(float), 0);
+        for (int y = 0; y < size.y; y++)
+        {
+            file.write(zeros.data(), zeros.size());
+        }
+    }
+    else
+    {
+        file.open(filename + ".exr", std::ios::binary);
+        writeHeaderEXR(image_size);
+    }
+}
+
+/*************************************************************************************
+Single level tiled OpenEXR file with uncompressed float B, G and R channels. Tiles are
+stored in the order they are written, which the RANDOM_Y line order allows, and the
+offset table after the header is filled in by finish.
+**************************************************************************************/
+void FloatImageWriter::writeHeaderEXR(const glm::ivec2& image_size)
+{
+    put(file, uint32_t(20000630));
+    put(file, uint32_t(2 | 0x200)); // version 2, tiled
+
+    putAttribute(file, "channels", "chlist", 3 * (2 + 16) + 1);
+    for (const char* channel : { "B", "G", "R" })
+    {
+        putString(file, channel);
+        put(file, int32_t(2)); // FLOAT
+        put(file, uint32_t(0)); // pLinear and reserved
+        put(file, int32_t(1));
+        put(file, int32_t(1));
+    }
+    put(file, uint8_t(0));
+
+    putAttribute(file, "compression", "compression", 1);
+    put(file, uint8_t(0));
+
+    putAttribute(file, "dataWindow", "box2i", 16);
+    put(file, glm::ivec2(min.x, min.y));
+    put(file, glm::ivec2(max.x - 1, max.y - 1));
+
+    putAttribute(file, "displayWindow", "box2i", 16);
+    put(file, glm::ivec2(0));
+    put(file, image_size - 1);
+
+    putAttribute(file, "lineOrder", "lineOrder", 1);
+    put(file, uint8_t(2)); // RANDOM_Y
+
+    putAttribute(file, "pixelAspectRatio", "float", 4);
+    put(file, 1.0f);
+
+    putAttribute(file, "screenWindowCenter", "v2f", 8);
+    put(file, 0.0f);
+    put(file, 0.0f);
+
+    putAttribute(file, "screenWindowWidth", "float", 4);
+    put(file, 1.0f);
+
+    putAttribute(file, "tiles", "tiledesc", 9);
+    put(file, uint32_t(tile_size));
+    put(file, uint32_t(tile_size));
+    put(file, uint8_t(0)); // ONE_LEVEL, ROUND_DOWN
+
+    put(file, uint8_t(0));
+
+    offset_table_position = file.tellp();
+    tile_offsets.assign(remaining_pixels.size(), 0);
+    file.write(reinterpret_cast<const char*>(tile_offsets.data()), tile_offsets.size() * sizeof(uint64_t));
+}
+
+void FloatImageWriter::write(const Image& image, const glm::ivec2& rect_min, const glm::ivec2& rect_max)
+{
+    glm::ivec2 r_min = glm::max(rect_min, min) - min, r_max = glm::min(rect_max, max) - min;
+    if (r_min.x >= r_max.x || r_min.y >= r_max.y) return;
+
+    std::lock_guard<std::mutex> lock(mutex);
+    for (int ty = r_min.y / tile_size; ty <= (r_max.y - 1) / tile_size; ty++)
+    {
+        for (int tx = r_min.x / tile_size; tx <= (r_max.x - 1) / tile_size; tx++)
+        {
+            glm::ivec2 overlap = glm::min(r_max, glm::ivec2(tx + 1, ty + 1) * tile_size) - glm::max(r_min, glm::ivec2(tx, ty) * tile_size);
+            size_t tile = ty * num_tiles.x + tx;
+            remaining_pixels[tile] -= std::min<uint32_t>(overlap.x * overlap.y, remaining_pixels[tile]);
+            if (remaining_pixels[tile] == 0)
+            {
+                writeTile(image, tile);
+            }
+        }
+    }
+}
+
+void FloatImageWriter::finish(const Image& image)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (size_t tile = 0; tile < remaining_pixels.size(); tile++)
+    {
+        if (remaining_pixels[tile] != UINT32_MAX)
+        {
+            writeTile(image, tile);
+        }
+    }
+
+    if (format == Format::EXR)
+    {
+        file.seekp(offset_table_position);
+        file.write(reinterpret_cast<const char*>(tile_offsets.data()), tile_offsets.size() * sizeof(uint64_t));
+    }
+    file.close();
+}
+
+// Tiles that are written are marked with UINT32_MAX remaining pixels
+void FloatImageWriter::writeTile(const Image& image, size_t tile)
+{
+    remaining_pixels[tile] = UINT32_MAX;
+
+    glm::ivec2 t(tile % num_tiles.x, tile / num_tiles.x);
+    glm::ivec2 t_min = min + t * tile_size;
+    glm::ivec2 t_max = glm::min(t_min + tile_size, max);
+    int width = t_max.x - t_min.x;
+
+    buffer.resize(size_t(width) * 3);
+
+    if (format == Format::PFM)
+    {
+        for (int y = t_min.y; y < t_max.y; y++)
+        {
+            for (int x = t_min.x; x < t_max.x; x++)
+            {
+                const glm::dvec3& p = image(x, y);
+                float* b = &buffer[3 * (x - t_min.x)];
+                b[0] = static_cast<float>(p.x);
+                b[1] = static_cast<float>(p.y);
+                b[2] = static_cast<float>(p.z);
+            }
+            size_t row = max.y - 1 - y;
+            file.seekp(pfm_pixels_start + static_cast<std::streamoff>((row * (max.x - min.x) + (t_min.x - min.x)) * 3 * sizeof(float)));
+            file.write(reinterpret_cast<const char*>(buffer.data()), buffer.size() * sizeof(float));
+        }
+        return;
+    }
+
+    file.seekp(0, std::ios::end);
+    tile_offsets[tile] = static_cast<uint64_t>(file.tellp());
+
+    put(file, int32_t(t.x));
+    put(file, int32_t(t.y));
+    put(file, int32_t(0));
+    put(file, int32_t(0));
+    put(file, int32_t(width * (t_max.y - t_min.y) * 3 * sizeof(float)));
+
+    // Each scanline of the tile holds all B values, then all G values and then all R values
+    for (int y = t_min.y; y < t_max.y; y++)
+    {
+        for (int x = t_min.x; x < t_max.x; x++)
+        {
+            const glm::dvec3& p = image(x, y);
+            buffer[x - t_min.x] = static_cast<float>(p.b);
+            buffer[width + x - t_min.x] = static_cast<float>(p.g);
+            buffer[2 * width + x - t_min.x] = static_cast<float>(p.r);
+        }
+        file.write(reinterpret_cast<const char*>(buffer.data()), buffer.size() * sizeof(float));
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <mutex>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <string>
+#include <cstdint>
+
+#include <glm/vec2.hpp>
+
+struct Image;
+
+/*************************************************************************************
+Writes the linear radiance of an image as 32-bit floats to a PFM file or to a tiled,
+uncompressed OpenEXR file. Both layouts have a fixed position for each pixel, so tiles
+can be written in any order while the image is rendered. The image is divided into
+tiles of 32x32 pixels, the size of the camera buckets, and each tile is written when
+all of its pixels are done.
+**************************************************************************************/
+class FloatImageWriter
+{
+public:
+    enum class Format
+    {
+        PFM,
+        EXR
+    };
+
+    // Writes the header. Only the rectangle from min to max of the image is saved, which EXR
+    // files place in the full image while PFM files only contain the rectangle.
+    FloatImageWriter(const std::string& filename, Format format, const glm::ivec2& image_size,
+                     const glm::ivec2& min, const glm::ivec2& max);
+
+    // Thread safe. The pixels of the rectangle are final, and tiles that are then done are written.
+    void write(const Image& image, const glm::ivec2& min, const glm::ivec2& max);
+
+    // Writes the tiles that have not been written and completes the file
+    void finish(const Image& image);
+
+private:
+    static constexpr int tile_size = 32;
+
+    void writeTile(const Image& image, size_t tile);
+    void writeHeaderEXR(const glm::ivec2& image_size);
+
+    Format format;
+    glm::ivec2 min, max;
+    glm::ivec2 num_tiles;
+
+    std::mutex mutex;
+    std::ofstream file;
+
+    std::vector<uint32_t> remaining_pixels; // of each tile
+    std::vector<uint64_t> tile_offsets;     // EXR offset table, 0 for tiles that are not written
+    uint64_t offset_table_position = 0;
+    std::streamoff pfm_pixels_start = 0;
+
+    std::vector<float> buffer;
+};
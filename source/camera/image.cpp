@@ -1,96 +1,356 @@
 #include "image.hpp"
 #include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <atomic>
 #include <glm/glm.hpp>
 #include <glm/gtx/component_wise.hpp>
 #include "pixel-operators.hpp"
 #include "../common/util.hpp"
+#include "../common/thread-pool.hpp"
 #include "../color/srgb.hpp"
 
-Image::Image(const nlohmann::json &j)
+namespace
+{
+    // Pixels per task of the parallel loops
+    const size_t chunk_size = 16384;
+}
+
+Image::Image(const nlohmann::json &j, bool first_touch)
 {
     width = j.at("width");
     height = j.at("height");
     num_pixels = width * height;
-    blob = std::vector<glm::dvec3>(num_pixels, glm::dvec3());
+    blob.resize(num_pixels);
+    if (!first_touch)
+    {
+        std::fill(blob.begin(), blob.end(), glm::dvec3(0.0));
+    }
+
+    crop_min = glm::ivec2(0);
+    crop_max = glm::ivec2(width, height);
+    if (j.find("crop") != j.end())
+    {
+        // x, y, width and height of the crop
+        std::vector<int> crop = j.at("crop");
+        if (crop.size() != 4 || crop[0] < 0 || crop[1] < 0 || crop[2] <= 0 || crop[3] <= 0 ||
+            size_t(crop[0] + crop[2]) > width || size_t(crop[1] + crop[3]) > height)
+        {
+            throw std::runtime_error("The crop must be x, y, width and height of a rectangle inside the image.");
+        }
+        crop_min = glm::ivec2(crop[0], crop[1]);
+        crop_max = crop_min + glm::ivec2(crop[2], crop[3]);
+        cropped = true;
+
+        // Pixels outside the crop are never sampled, but passes still read all pixels
+        if (first_touch)
+        {
+            for (int y = 0; y < int(height); y++)
+            {
+                bool crop_row = y >= crop_min.y && y < crop_max.y;
+                for (int x = 0; x < int(width); x++)
+                {
+                    if (!crop_row || x < crop_min.x || x >= crop_max.x) (*this)(x, y) = glm::dvec3(0.0);
+                }
+            }
+        }
+    }
 
     plain = getOptional(j, "plain", false);
 
+    if (j.find("float_format") != j.end())
+    {
+        std::string format = j.at("float_format");
+        std::transform(format.begin(), format.end(), format.begin(), toupper);
+        if (format != "PFM" && format != "EXR")
+        {
+            throw std::runtime_error("The float format must be pfm or exr.");
+        }
+        has_float_format = true;
+        float_format = format == "EXR" ? FloatImageWriter::Format::EXR : FloatImageWriter::Format::PFM;
+    }
+
     double exposure_EV = getOptional(j, "exposure_compensation", 0.0);
     double gain_EV = getOptional(j, "gain_compensation", 0.0);
 
     exposure_scale = std::pow(2, exposure_EV);
     gain_scale = std::pow(2, gain_EV);
 
-    std::string tonemapper = getOptional<std::string>(j, "tonemapper", "HABLE");
-    std::transform(tonemapper.begin(), tonemapper.end(), tonemapper.begin(), toupper);
+    std::string tonemapper_str = getOptional<std::string>(j, "tonemapper", "HABLE");
+    std::transform(tonemapper_str.begin(), tonemapper_str.end(), tonemapper_str.begin(), toupper);
 
     if (plain)
-        tonemap = linear;
+        tonemapper = Tonemapper::LINEAR;
     else
-        if (tonemapper == "ACES")
-            tonemap = filmicACES;
+        if (tonemapper_str == "ACES")
+            tonemapper = Tonemapper::ACES;
         else 
-            tonemap = filmicHable;
+            tonemapper = Tonemapper::HABLE;
+}
+
+namespace
+{
+    // Header of crop files, followed by the pixels of the crop as 32-bit floats
+    struct HeaderCrop
+    {
+        char magic[8];
+        uint32_t width, height; // of the full image
+        int32_t x, y;           // of the crop
+        uint32_t crop_width, crop_height;
+    };
 }
 
 void Image::save(const std::string& filename) const
 {
-    double exposure_factor = plain ? 1.0 : getExposure() * exposure_scale;
-    double gain_factor = plain ? 1.0 : getGain(exposure_factor) * gain_scale;
+    if (!cropped)
+    {
+        saveTGA(filename);
+        return;
+    }
+
+    // The exposure is then only computed from the pixels of the crop
+    crop().saveTGA(filename);
 
-    HeaderTGA header((uint16_t)width, (uint16_t)height);
-    std::ofstream out_tonemapped(filename + ".tga", std::ios::binary);
-    out_tonemapped.write(reinterpret_cast<char*>(&header), sizeof(header));
-    for (const auto& p : blob)
+    HeaderCrop header;
+    std::memcpy(header.magic, "MCRTCROP", 8);
+    header.width = static_cast<uint32_t>(width);
+    header.height = static_cast<uint32_t>(height);
+    header.x = crop_min.x;
+    header.y = crop_min.y;
+    header.crop_width = static_cast<uint32_t>(crop_max.x - crop_min.x);
+    header.crop_height = static_cast<uint32_t>(crop_max.y - crop_min.y);
+
+    std::vector<float> data;
+    data.reserve(numCropPixels() * 3);
+    for (int y = crop_min.y; y < crop_max.y; y++)
     {
-        std::vector<uint8_t> fp = truncate(sRGB::gammaCompress(tonemap(p * exposure_factor) * gain_factor));
-        out_tonemapped.write(reinterpret_cast<char*>(fp.data()), fp.size() * sizeof(uint8_t));
+        for (int x = crop_min.x; x < crop_max.x; x++)
+        {
+            const glm::dvec3& p = blob[y * width + x];
+            data.insert(data.end(), { static_cast<float>(p.x), static_cast<float>(p.y), static_cast<float>(p.z) });
+        }
     }
-    out_tonemapped.close();
+
+    std::ofstream out(filename + ".crop", std::ios::binary);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    out.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(float));
 }
 
-glm::dvec3& Image::operator()(size_t col, size_t row)
+Image Image::crop() const
 {
-    return blob[row * width + col];
+    Image image;
+    image.plain = plain;
+    image.tonemapper = tonemapper;
+    image.exposure_scale = exposure_scale;
+    image.gain_scale = gain_scale;
+    image.width = crop_max.x - crop_min.x;
+    image.height = crop_max.y - crop_min.y;
+    image.num_pixels = image.width * image.height;
+    image.crop_min = glm::ivec2(0);
+    image.crop_max = glm::ivec2(image.width, image.height);
+    image.blob.resize(image.num_pixels);
+    for (size_t y = 0; y < image.height; y++)
+    {
+        for (size_t x = 0; x < image.width; x++)
+        {
+            image.blob[y * image.width + x] = blob[(y + crop_min.y) * width + x + crop_min.x];
+        }
+    }
+    return image;
 }
 
-/*******************************************************************************************
-Histogram method to find the intensity level L that 50% of the pixels has higher/lower intensity than.
-The returned exposure factor is then 0.5/L, which if multiplied by each pixel in the image will make 
-50% of the pixels be < 0.5 and 50% of the pixels be > 0.5.
-********************************************************************************************/
-double Image::getExposure() const
+Image Image::mergeCrops(const std::vector<std::filesystem::path>& crops)
 {
-    auto get_t = [&](const glm::dvec3 &p)
+    Image image;
+    for (const auto& path : crops)
     {
-        return glm::compAdd(p) / 3.0;
-    };
+        std::ifstream in(path, std::ios::binary);
+        HeaderCrop header;
+        if (!in.read(reinterpret_cast<char*>(&header), sizeof(header)) || std::memcmp(header.magic, "MCRTCROP", 8) != 0)
+        {
+            throw std::runtime_error(path.string() + " is not a crop file.");
+        }
+
+        if (image.blob.empty())
+        {
+            image = Image({ { "width", header.width }, { "height", header.height } });
+        }
+        else if (header.width != image.width || header.height != image.height)
+        {
+            throw std::runtime_error(path.string() + " is a crop of an image with another resolution.");
+        }
+
+        if (header.x < 0 || header.y < 0 || header.x + header.crop_width > header.width || header.y + header.crop_height > header.height)
+        {
+            throw std::runtime_error(path.string() + " has a crop outside of the image.");
+        }
+
+        std::vector<float> data(size_t(header.crop_width) * header.crop_height * 3);
+        if (!in.read(reinterpret_cast<char*>(data.data()), data.size() * sizeof(float)))
+        {
+            throw std::runtime_error(path.string() + " is truncated.");
+        }
+
+        for (size_t i = 0; i < data.size() / 3; i++)
+        {
+            image(header.x + i % header.crop_width, header.y + i / header.crop_width) = glm::dvec3(data[3 * i], data[3 * i + 1], data[3 * i + 2]);
+        }
+    }
+    return image;
+}
+
+void Image::savePFM(const std::string& filename) const
+{
+    FloatImageWriter(filename, FloatImageWriter::Format::PFM, glm::ivec2(width, height), glm::ivec2(0), glm::ivec2(width, height)).finish(*this);
+}
+
+std::unique_ptr<FloatImageWriter> Image::createFloatWriter(const std::string& filename) const
+{
+    if (!has_float_format) return nullptr;
+    return std::make_unique<FloatImageWriter>(filename, float_format, glm::ivec2(width, height), crop_min, crop_max);
+}
+
+template <class F>
+void Image::withTonemapper(F f) const
+{
+    switch (tonemapper)
+    {
+        case Tonemapper::LINEAR:
+            f([](const glm::dvec3& c) { return linear(c); });
+            break;
+        case Tonemapper::ACES:
+            f([](const glm::dvec3& c) { return filmicACES(c); });
+            break;
+        default:
+            f([](const glm::dvec3& c) { return filmicHable(c); });
+            break;
+    }
+}
+
+template <class Luminance>
+bool Image::histogram(Luminance luminance, double& bin_size) const
+{
+    ThreadPool& pool = ThreadPool::get();
+    size_t num_participants = pool.size() + 1;
+    std::vector<uint32_t>& bins = histogram_bins;
+    bins.resize(65536);
+
+    // Each thread reduces into its own maximum and histogram, which are merged afterwards
+    std::vector<double>& maxima = partial_maxima;
+    maxima.assign(num_participants, 0.0);
+    pool.parallelFor(num_pixels, chunk_size, [&](size_t begin, size_t end, size_t participant)
+    {
+        double max = maxima[participant];
+        for (size_t i = begin; i < end; i++)
+        {
+            double t = luminance(blob[i]);
+            if (max < t) max = t;
+        }
+        maxima[participant] = max;
+    });
 
     double max = 0.0;
-    for (const auto& p : blob)
+    for (double m : maxima)
     {
-        double t = get_t(p);
-        if (max < t) max = t;
+        if (max < m) max = m;
     }
 
-    if (max <= 0) return 1.0;
+    if (max <= 0) return false;
+
+    bin_size = max / bins.size();
+
+    std::vector<uint32_t>& partial = partial_bins;
+    partial.assign(num_participants * bins.size(), 0);
+    std::atomic_bool negative = false;
+    pool.parallelFor(num_pixels, chunk_size, [&](size_t begin, size_t end, size_t participant)
+    {
+        uint32_t* h = &partial[participant * bins.size()];
+        for (size_t i = begin; i < end; i++)
+        {
+            double t = luminance(blob[i]);
+            if (t < 0)
+            {
+                negative = true;
+                return;
+            }
+            h[std::min((size_t)(t / bin_size), bins.size() - 1)]++;
+        }
+    });
+
+    if (negative) return false;
+
+    // Merged in parallel over ranges of bins
+    pool.parallelFor(bins.size(), 4096, [&](size_t begin, size_t end, size_t)
+    {
+        for (size_t i = begin; i < end; i++)
+        {
+            uint32_t count = 0;
+            for (size_t p = 0; p < num_participants; p++)
+            {
+                count += partial[p * bins.size() + i];
+            }
+            bins[i] = count;
+        }
+    });
+    return true;
+}
+
+void Image::saveTGA(const std::string& filename) const
+{
+    withTonemapper([&](auto tonemap)
+    {
+        double exposure_factor = plain ? 1.0 : getExposure() * exposure_scale;
+        double gain_factor = plain ? 1.0 : getGain(tonemap, exposure_factor) * gain_scale;
+
+        // The file is built in memory by all threads and written at once
+        HeaderTGA header((uint16_t)width, (uint16_t)height);
+        std::vector<uint8_t>& data = tga_data;
+        data.resize(sizeof(header) + 3 * num_pixels);
+        std::memcpy(data.data(), &header, sizeof(header));
+        uint8_t* pixels = data.data() + sizeof(header);
+
+        ThreadPool::get().parallelFor(num_pixels, chunk_size, [&](size_t begin, size_t end, size_t)
+        {
+            for (size_t i = begin; i < end; i++)
+            {
+                truncate(sRGB::gammaCompress(tonemap(blob[i] * exposure_factor) * gain_factor), pixels + 3 * i);
+            }
+        });
+
+        std::ofstream out_tonemapped(filename + ".tga", std::ios::binary);
+        out_tonemapped.write(reinterpret_cast<const char*>(data.data()), data.size());
+    });
+}
+
+glm::dvec3& Image::operator()(size_t col, size_t row)
+{
+    return blob[row * width + col];
+}
 
-    std::vector<size_t> histogram(65536, 0);
-    double bin_size = max / histogram.size();
+const glm::dvec3& Image::operator()(size_t col, size_t row) const
+{
+    return blob[row * width + col];
+}
 
-    for (const auto& p : blob)
+/*******************************************************************************************
+Histogram method to find the intensity level L that 50% of the pixels has higher/lower intensity than.
+The returned exposure factor is then 0.5/L, which if multiplied by each pixel in the image will make 
+50% of the pixels be < 0.5 and 50% of the pixels be > 0.5.
+********************************************************************************************/
+double Image::getExposure() const
+{
+    double bin_size;
+    if (!histogram([](const glm::dvec3& p) { return glm::compAdd(p) / 3.0; }, bin_size))
     {
-        double t = get_t(p);
-        if (t < 0) return 1.0;
-        histogram[std::min((size_t)(t / bin_size), histogram.size() - 1)]++;
+        return 1.0;
     }
 
     size_t half_of_pixels = static_cast<size_t>(blob.size() * 0.5);
     size_t count = 0;
     double L = 0.5;
-    for (size_t i = 0; i < histogram.size(); i++)
+    for (size_t i = 0; i < histogram_bins.size(); i++)
     {
-        count += histogram[i];
+        count += histogram_bins[i];
         if (count >= half_of_pixels)
         {
             L = (i + 1) * bin_size;
@@ -104,38 +364,21 @@ double Image::getExposure() const
 Histogram method to find the gain that positions the histogram 
 to the right such that 0.5% of image pixels are clipped
 **************************************************************/
-double Image::getGain(double exposure_factor) const
+template <class Tonemap>
+double Image::getGain(Tonemap tonemap, double exposure_factor) const
 {
-    auto get_t = [&](const glm::dvec3 &p)
+    double bin_size;
+    if (!histogram([&](const glm::dvec3& p) { return glm::compAdd(tonemap(p * exposure_factor)) / 3.0; }, bin_size))
     {
-        return glm::compAdd(tonemap(p * exposure_factor)) / 3.0;
-    };
-
-    double max = 0.0;
-    for (const auto& p : blob)
-    {
-        double t = get_t(p);
-        if (max < t) max = t;
-    }
-
-    if (max <= 0) return 1.0;
-
-    std::vector<size_t> histogram(65536, 0);
-    double bin_size = max / histogram.size();
-
-    for (const auto& p : blob)
-    {
-        double t = get_t(p);
-        if (t < 0) return 1.0;
-        histogram[std::min((size_t)(t / bin_size), histogram.size() - 1)]++;
+        return 1.0;
     }
 
     size_t num_clipped_pixels = static_cast<size_t>(blob.size() * 0.01);
     size_t count = 0;
     double L = 0.99;
-    for (size_t i = histogram.size() - 1; i >= 0; i--)
+    for (size_t i = histogram_bins.size(); i-- > 0; )
     {
-        count += histogram[i];
+        count += histogram_bins[i];
         if (count >= num_clipped_pixels)
         {
             L = (i + 1) * bin_size;
@@ -143,4 +386,4 @@ double Image::getGain(double exposure_factor) const
         }
     }
     return 0.99 / L;
-}
\ No newline at end of file
+}
@@ -2,35 +2,91 @@
 
 #include <vector>
 #include <cstdint>
-#include <functional>
+#include <filesystem>
 
+#include <glm/vec2.hpp>
 #include <glm/vec3.hpp>
 
 #include <nlohmann/json.hpp>
 
+#include "float-image-writer.hpp"
+#include "../common/numa.hpp"
+
 struct Image
 {
     Image() { }
-    Image(const nlohmann::json &j);
+    // Pixels of the crop are left uninitialized if first_touch is set, so that their memory is placed
+    // on the NUMA node of the thread that first writes them
+    Image(const nlohmann::json &j, bool first_touch = false);
 
+    // Cropped images only save the crop, and also write it to filename.crop for mergeCrops
     void save(const std::string& filename) const;
 
+    // Linear radiance as a portable float map
+    void savePFM(const std::string& filename) const;
+
+    // Writer of the linear radiance of the crop in the float format of the image, nullptr if it has none
+    std::unique_ptr<FloatImageWriter> createFloatWriter(const std::string& filename) const;
+
+    // Full frame image of the crop files, later files are pasted over earlier ones
+    static Image mergeCrops(const std::vector<std::filesystem::path>& crops);
+
     glm::dvec3& operator()(size_t col, size_t row);
+    const glm::dvec3& operator()(size_t col, size_t row) const;
 
     size_t width, height;
     size_t num_pixels;
 
+    // Rectangle of pixels that is rendered, the whole image unless the image has a crop
+    glm::ivec2 crop_min, crop_max;
+    bool cropped = false;
+
+    size_t numCropPixels() const
+    {
+        return static_cast<size_t>(crop_max.x - crop_min.x) * (crop_max.y - crop_min.y);
+    }
+
 private:
+    // Copy of the crop with the same tonemapping settings
+    Image crop() const;
+    void saveTGA(const std::string& filename) const;
+
+    enum class Tonemapper
+    {
+        LINEAR,
+        HABLE,
+        ACES
+    };
+
+    // Calls f with the tonemapper as a function object, so that it can be inlined into the pixel loops of f
+    template <class F>
+    void withTonemapper(F f) const;
+
+    // Histogram of the luminance of the pixels in histogram_bins, with bins up to the maximum luminance.
+    // Returns false if the image is black or has negative luminance.
+    template <class Luminance>
+    bool histogram(Luminance luminance, double& bin_size) const;
+
     double getExposure() const;
-    double getGain(double exposure_factor) const;
 
-    std::vector<glm::dvec3> blob;
+    template <class Tonemap>
+    double getGain(Tonemap tonemap, double exposure_factor) const;
+
+    std::vector<glm::dvec3, NUMA::FirstTouchAllocator<glm::dvec3>> blob;
     double exposure_scale, gain_scale;
 
-    std::function<glm::dvec3(const glm::dvec3&)> tonemap;
+    Tonemapper tonemapper;
 
     bool plain; // No tonemapping or autoexposure/-gain
 
+    bool has_float_format = false;
+    FloatImageWriter::Format float_format;
+
+    // Reused by each save, so that saving only allocates the first time. An image is not saved concurrently.
+    mutable std::vector<uint32_t> histogram_bins, partial_bins;
+    mutable std::vector<double> partial_maxima;
+    mutable std::vector<uint8_t> tga_data;
+
     /**************************************************************************
     Hard coded (except for dimensions) uncompressed 24bpp true-color TGA header.
     After writing this to file, the RGB bytes can be dumped in sequence
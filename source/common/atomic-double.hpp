@@ -0,0 +1,42 @@
+/**************************************************************
+Lock-free accumulator that several threads can add to
+concurrently. Unlike std::atomic<double>, it can be copied and
+stored in resizable containers, but copying is not thread safe.
+***************************************************************/
+
+#pragma once
+
+#include <atomic>
+
+class AtomicDouble
+{
+public:
+    AtomicDouble(double value = 0.0) : value(value) { }
+
+    AtomicDouble(const AtomicDouble& other) : value(other.load()) { }
+
+    AtomicDouble& operator=(const AtomicDouble& other)
+    {
+        value.store(other.load(), std::memory_order_relaxed);
+        return *this;
+    }
+
+    void add(double x)
+    {
+        double expected = value.load(std::memory_order_relaxed);
+        while (!value.compare_exchange_weak(expected, expected + x, std::memory_order_relaxed)) { }
+    }
+
+    double load() const
+    {
+        return value.load(std::memory_order_relaxed);
+    }
+
+    operator double() const
+    {
+        return load();
+    }
+
+private:
+    std::atomic<double> value;
+};
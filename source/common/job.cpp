@@ -0,0 +1,190 @@
+#include "job.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+
+#include "util.hpp"
+#include "thread-pool.hpp"
+#include "../camera/camera.hpp"
+#include "../camera/animation.hpp"
+#include "../integrator/integrator.hpp"
+#include "../scene/scene.hpp"
+
+Job parseJob(const nlohmann::json& j, const std::filesystem::path& directory)
+{
+    Job job;
+    if (j.at("scene").is_object())
+    {
+        job.scene = directory / "scene.json";
+        job.scene_json = j.at("scene");
+    }
+    else
+    {
+        job.scene = directory / j.at("scene").get<std::string>();
+    }
+    job.cameras = getOptional(j, "cameras", std::vector<size_t>());
+    job.integrator = parseIntegrator(getOptional<std::string>(j, "integrator", "path_tracer"));
+    job.sqrtspp = getOptional(j, "sqrtspp", -1);
+    job.time_budget = getOptional(j, "time_budget", -1.0);
+    if (j.find("output") != j.end())
+    {
+        job.output = directory / j.at("output").get<std::string>();
+    }
+    return job;
+}
+
+std::vector<Job> readJobs(const std::filesystem::path& manifest)
+{
+    std::ifstream manifest_file(manifest);
+    if (!manifest_file)
+    {
+        throw std::runtime_error("Could not open job manifest " + manifest.string());
+    }
+
+    nlohmann::json j;
+    manifest_file >> j;
+
+    std::filesystem::path directory = std::filesystem::absolute(manifest).parent_path();
+
+    std::vector<Job> jobs;
+    for (const auto& j_job : j.at("jobs"))
+    {
+        jobs.push_back(parseJob(j_job, directory));
+    }
+    return jobs;
+}
+
+nlohmann::json readScene(const Job& job)
+{
+    if (!job.scene_json.is_null())
+    {
+        return job.scene_json;
+    }
+
+    std::ifstream scene_file(job.scene);
+    if (!scene_file)
+    {
+        throw std::runtime_error("Could not open scene " + job.scene.string());
+    }
+    nlohmann::json j;
+    scene_file >> j;
+    return j;
+}
+
+std::vector<nlohmann::json> jobCameras(const Job& job, const nlohmann::json& scene)
+{
+    std::vector<size_t> indices = job.cameras;
+    if (indices.empty())
+    {
+        indices.resize(scene.at("cameras").size());
+        std::iota(indices.begin(), indices.end(), 0);
+    }
+
+    if (!job.output.empty())
+    {
+        std::filesystem::create_directories(job.output);
+    }
+
+    std::vector<nlohmann::json> cameras;
+    for (size_t idx : indices)
+    {
+        nlohmann::json c = scene.at("cameras").at(idx);
+        if (job.sqrtspp > 0) c["sqrtspp"] = job.sqrtspp;
+        if (job.time_budget > 0.0) c["time_budget"] = job.time_budget;
+        if (!job.output.empty()) c["savename"] = (job.output / c.at("savename").get<std::string>()).string();
+        cameras.push_back(c);
+    }
+    return expandFrames(cameras);
+}
+
+std::vector<nlohmann::json> expandFrames(const std::vector<nlohmann::json>& cameras)
+{
+    std::vector<nlohmann::json> frames;
+    for (const auto& c : cameras)
+    {
+        auto camera_frames = Animation::frames(c);
+        frames.insert(frames.end(), camera_frames.begin(), camera_frames.end());
+    }
+    return frames;
+}
+
+// Each camera is created before the previous one captures, so that its rendering can start as soon as
+// threads run out of work in the previous one
+void renderCameras(const std::vector<nlohmann::json>& cameras, std::shared_ptr<Integrator> integrator,
+                   std::function<void(double)> progress, std::function<void(const Camera&)> captured)
+{
+    std::vector<std::unique_ptr<Camera>> queued(cameras.size());
+    for (size_t i = 0; i < cameras.size(); i++)
+    {
+        for (size_t k = i; k < std::min(i + 2, cameras.size()); k++)
+        {
+            if (!queued[k])
+            {
+                queued[k] = std::make_unique<Camera>(cameras[k], integrator);
+                queued[k]->progress_callback = progress;
+            }
+        }
+
+        if (cameras.size() > 1)
+        {
+            std::cout << std::endl << "Camera " << i + 1 << "/" << cameras.size() << ": " << queued[i]->savename << std::endl;
+        }
+        Camera* next = i + 1 < cameras.size() ? queued[i + 1].get() : nullptr;
+        try
+        {
+            queued[i]->capture(next);
+        }
+        catch (...)
+        {
+            // The pass of the next camera may have been started by this one, and its workers use the camera
+            if (next)
+            {
+                try
+                {
+                    next->waitForStartedPass();
+                }
+                catch (...) { }
+            }
+            throw;
+        }
+        if (captured) captured(*queued[i]);
+        queued[i].reset();
+    }
+}
+
+JobRunner::JobRunner(size_t cache_size) : integrators(cache_size)
+{
+    Scene::setCacheSize(cache_size);
+}
+
+void JobRunner::run(const Job& job, std::function<void(double)> progress, std::function<void(const Camera&)> captured)
+{
+    nlohmann::json j = readScene(job);
+    Scene::path = job.scene.parent_path();
+
+    renderCameras(jobCameras(job, j), integrator(j, job.integrator), progress, captured);
+}
+
+std::shared_ptr<Integrator> JobRunner::integrator(const nlohmann::json& j, Option::IntegratorType type)
+{
+    // Integrators can be reused if everything but the cameras is the same
+    nlohmann::json settings = j;
+    settings.erase("cameras");
+    size_t key = std::hash<std::string>()(Scene::contentKey(j) + settings.dump() + std::to_string(static_cast<int>(type)));
+
+    if (auto cached = integrators.get(key))
+    {
+        // Jobs in between may have started the thread pool with other settings
+        std::cout << "\nReusing cached integrator." << std::endl;
+        ThreadPool::get().resize((*cached)->num_threads, (*cached)->numa);
+        return *cached;
+    }
+
+    integrators.makeRoom(1);
+    auto integrator = Camera::createIntegrator(j, type);
+    integrators.put(key, integrator);
+    return integrator;
+}
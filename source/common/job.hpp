@@ -0,0 +1,70 @@
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <filesystem>
+
+#include <nlohmann/json.hpp>
+
+#include "option.hpp"
+#include "lru-cache.hpp"
+
+class Camera;
+class Integrator;
+
+/*************************************************************************************
+Render job of a batch manifest or a render server request, which is rendered without 
+any interaction. Relative paths are relative to the directory of the manifest.
+**************************************************************************************/
+struct Job
+{
+    std::filesystem::path scene;
+    nlohmann::json scene_json; // used instead of reading scene if not null
+    std::vector<size_t> cameras; // all cameras of the scene if empty
+    Option::IntegratorType integrator = Option::IntegratorType::PATH_TRACER;
+
+    // Overrides of the camera settings, unused if negative
+    int sqrtspp = -1;
+    double time_budget = -1.0;
+
+    // Directory of the rendered images, the current directory if empty
+    std::filesystem::path output;
+};
+
+Job parseJob(const nlohmann::json& j, const std::filesystem::path& directory);
+
+std::vector<Job> readJobs(const std::filesystem::path& manifest);
+
+// Scene file of the job, throws if it cannot be read
+nlohmann::json readScene(const Job& job);
+
+// Frames of the cameras of the job, with the overrides of the job applied. Creates the output directory.
+std::vector<nlohmann::json> jobCameras(const Job& job, const nlohmann::json& scene);
+
+// Animated cameras are rendered as one camera per frame
+std::vector<nlohmann::json> expandFrames(const std::vector<nlohmann::json>& cameras);
+
+// Renders the cameras one after another with the integrator. captured is called after each camera has saved its image.
+void renderCameras(const std::vector<nlohmann::json>& cameras, std::shared_ptr<Integrator> integrator,
+                   std::function<void(double)> progress = nullptr, std::function<void(const Camera&)> captured = nullptr);
+
+/*************************************************************************************
+Renders jobs and keeps the integrators, and with them the photon maps, of the most 
+recently rendered jobs for reuse by later jobs with the same scene and integrator.
+**************************************************************************************/
+class JobRunner
+{
+public:
+    // Also sets the number of cached scenes and meshes
+    JobRunner(size_t cache_size);
+
+    // Throws if the job fails
+    void run(const Job& job, std::function<void(double)> progress = nullptr, std::function<void(const Camera&)> captured = nullptr);
+
+    // Cached integrator of the scene, or a new one. Scene::path must be set to the directory of the scene.
+    std::shared_ptr<Integrator> integrator(const nlohmann::json& j, Option::IntegratorType type);
+
+private:
+    LRUCache<size_t, std::shared_ptr<Integrator>> integrators;
+};
@@ -0,0 +1,70 @@
+/*************************************************************************
+Cache of the most recently used values, which evicts the least recently 
+used value when a value is added to a full cache. Not thread safe.
+**************************************************************************/
+
+#pragma once
+
+#include <list>
+#include <unordered_map>
+#include <utility>
+#include <algorithm>
+
+template <class Key, class Value>
+class LRUCache
+{
+public:
+    LRUCache(size_t capacity) : capacity(std::max(capacity, size_t(1))) { }
+
+    // Returns nullptr if the key is not cached, and otherwise marks the value as most recently used
+    Value* get(const Key& key)
+    {
+        auto i = index.find(key);
+        if (i == index.end()) return nullptr;
+
+        entries.splice(entries.begin(), entries, i->second);
+        return &i->second->second;
+    }
+
+    void put(const Key& key, Value value)
+    {
+        auto i = index.find(key);
+        if (i != index.end())
+        {
+            i->second->second = std::move(value);
+            entries.splice(entries.begin(), entries, i->second);
+            return;
+        }
+
+        makeRoom(1);
+        entries.emplace_front(key, std::move(value));
+        index[key] = entries.begin();
+    }
+
+    // Evicts values until n more fit, which can be used to free memory before a new value is created
+    void makeRoom(size_t n)
+    {
+        while (!entries.empty() && entries.size() + n > capacity)
+        {
+            index.erase(entries.back().first);
+            entries.pop_back();
+        }
+    }
+
+    void resize(size_t new_capacity)
+    {
+        capacity = std::max(new_capacity, size_t(1));
+        makeRoom(0);
+    }
+
+    void clear()
+    {
+        entries.clear();
+        index.clear();
+    }
+
+private:
+    size_t capacity;
+    std::list<std::pair<Key, Value>> entries;
+    std::unordered_map<Key, typename std::list<std::pair<Key, Value>>::iterator> index;
+};
@@ -0,0 +1,113 @@
+#include "numa.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <filesystem>
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+namespace
+{
+    thread_local size_t current_node = 0;
+
+    // Parses cpulist files, e.g. "0-3,8-11"
+    std::vector<int> parseCPUList(const std::string& list)
+    {
+        std::vector<int> cpus;
+        std::stringstream ss(list);
+        std::string range;
+        while (std::getline(ss, range, ','))
+        {
+            if (range.empty() || range == "\n") continue;
+
+            size_t dash = range.find('-');
+            int first = std::stoi(range.substr(0, dash));
+            int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+            for (int cpu = first; cpu <= last; cpu++)
+            {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+
+    // CPUs of each node that has any, ordered by node number
+    const std::vector<std::vector<int>>& topology()
+    {
+        static const std::vector<std::vector<int>> nodes = []()
+        {
+            std::vector<std::vector<int>> nodes;
+            std::filesystem::path sysfs("/sys/devices/system/node");
+            std::error_code ec;
+            for (size_t node = 0; std::filesystem::exists(sysfs / ("node" + std::to_string(node)), ec); node++)
+            {
+                std::ifstream file(sysfs / ("node" + std::to_string(node)) / "cpulist");
+                std::string list;
+                std::getline(file, list);
+                auto cpus = parseCPUList(list);
+                if (!cpus.empty())
+                {
+                    nodes.push_back(cpus);
+                }
+            }
+            // An empty CPU list means that threads are not bound
+            if (nodes.empty())
+            {
+                nodes.emplace_back();
+            }
+            return nodes;
+        }();
+        return nodes;
+    }
+}
+
+size_t NUMA::numNodes()
+{
+    return topology().size();
+}
+
+void NUMA::bindThread(size_t node)
+{
+    node %= numNodes();
+    current_node = node;
+
+#ifdef __linux__
+    const auto& cpus = topology()[node];
+    if (cpus.empty()) return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus)
+    {
+        if (cpu < CPU_SETSIZE) CPU_SET(cpu, &set);
+    }
+    sched_setaffinity(0, sizeof(set), &set);
+#endif
+}
+
+size_t NUMA::currentNode()
+{
+    return current_node;
+}
+
+void NUMA::onEachNode(std::function<void(size_t)> f)
+{
+    std::vector<std::thread> threads;
+    for (size_t node = 0; node < numNodes(); node++)
+    {
+        threads.emplace_back([&f, node]()
+        {
+            bindThread(node);
+            f(node);
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
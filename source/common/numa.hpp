@@ -0,0 +1,60 @@
+/*************************************************************************
+NUMA topology and placement helpers. Memory pages are placed on the node of
+the thread that first writes to them, so data is put on a node by letting a
+thread bound to that node allocate and fill it. The topology is read from
+sysfs, and a machine without NUMA support is treated as a single node.
+**************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <functional>
+#include <new>
+#include <utility>
+
+namespace NUMA
+{
+    size_t numNodes();
+
+    // Binds the calling thread to the CPUs of the node. The node of unbound threads is 0.
+    void bindThread(size_t node);
+    size_t currentNode();
+
+    // Runs f(node) concurrently on one temporary thread bound to each node, and returns when all are done
+    void onEachNode(std::function<void(size_t)> f);
+
+    // One copy of value per node, each allocated and copied by a thread bound to its node
+    template <class T>
+    std::vector<std::unique_ptr<T>> replicate(const T& value)
+    {
+        std::vector<std::unique_ptr<T>> replicas(numNodes());
+        onEachNode([&](size_t node)
+        {
+            replicas[node] = std::make_unique<T>(value);
+        });
+        return replicas;
+    }
+
+    // Leaves elements of trivial types uninitialized, so that the pages of the memory are first touched by their user
+    template <class T>
+    struct FirstTouchAllocator : public std::allocator<T>
+    {
+        template <class U>
+        struct rebind { using other = FirstTouchAllocator<U>; };
+
+        FirstTouchAllocator() = default;
+
+        template <class U>
+        FirstTouchAllocator(const FirstTouchAllocator<U>&) noexcept { }
+
+        template <class U, class... Args>
+        void construct(U* p, Args&&... args)
+        {
+            if constexpr (sizeof...(Args) == 0)
+                ::new(static_cast<void*>(p)) U;
+            else
+                ::new(static_cast<void*>(p)) U(std::forward<Args>(args)...);
+        }
+    };
+}
@@ -3,11 +3,17 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <cctype>
+#include <numeric>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
 
 #include <glm/vec3.hpp>
 #include <nlohmann/json.hpp>
 
 #include "util.hpp"
+#include "../camera/animation.hpp"
 
 std::vector<Option> availible(std::filesystem::path path)
 {
@@ -23,7 +29,7 @@ std::vector<Option> availible(std::filesystem::path path)
 
         bool photon_map = j.find("photon_map") != j.end();
 
-        int i = 0;
+        size_t i = 0;
         for (const auto& c : j.at("cameras"))
         {
             glm::dvec3 eye = c.at("eye");
@@ -32,14 +38,38 @@ std::vector<Option> availible(std::filesystem::path path)
             std::stringstream ss;
             ss << "Eye: " << std::fixed << std::setprecision(0) << "(" << eye.x << " " << eye.y << " " << eye.z << "), ";
             ss << "Focal length: " << int(f) << "mm (" << int(s) << "mm)";
-            options.emplace_back(file.path(), ss.str(), i, photon_map);
+            if (Animation::numFrames(c) > 1)
+            {
+                ss << ", Frames: " << Animation::numFrames(c);
+            }
+            options.emplace_back(file.path(), ss.str(), std::vector<size_t>{ i }, photon_map);
             i++;
         }
+
+        if (i > 1)
+        {
+            std::vector<size_t> cameras(i);
+            std::iota(cameras.begin(), cameras.end(), 0);
+            options.emplace_back(file.path(), "All " + std::to_string(i) + " cameras", cameras, photon_map);
+        }
         scene_file.close();
     }
     return options;
 }
 
+Option::IntegratorType parseIntegrator(std::string name)
+{
+    std::transform(name.begin(), name.end(), name.begin(), tolower);
+
+    if (name == "p" || name == "path_tracer") return Option::IntegratorType::PATH_TRACER;
+    if (name == "m" || name == "photon_mapper") return Option::IntegratorType::PHOTON_MAPPER;
+    if (name == "b" || name == "bdpt") return Option::IntegratorType::BDPT;
+    if (name == "v" || name == "vcm") return Option::IntegratorType::VCM;
+    if (name == "l" || name == "mlt") return Option::IntegratorType::MLT;
+
+    throw std::runtime_error("Unknown integrator: " + name);
+}
+
 Option getOption(std::vector<Option>& options)
 {
     size_t max_opt = 13, max_fil = 0, max_cam = 0;
@@ -93,19 +123,42 @@ Option getOption(std::vector<Option>& options)
             break;
     }
 
-    if (options[option].photon_map)
+    bool photon_map = options[option].photon_map;
+
+    char a;
+    std::cout << "\nSelect integrator, path tracer (p), " << (photon_map ? "photon mapper (m), " : "") << "bidirectional path tracer (b), vertex connection and merging (v) or Metropolis light transport (l): ";
+    while (std::cin >> a)
     {
-        char a;
-        std::cout << "\nUse photon mapping? (y/n) ";
-        while (std::cin >> a)
-        {
-            if (a == 'y' || a == 'Y' || a == 'n' || a == 'N') break;
-            std::cout << "Answer with the letters y or n: ";
-        }
-        if (a == 'n' || a == 'N')
+        a = static_cast<char>(std::tolower(a));
+        if (a == 'p' || a == 'b' || a == 'v' || a == 'l' || (a == 'm' && photon_map)) break;
+        std::cout << "Answer with one of the letters in parentheses: ";
+    }
+
+    // Cameras are chosen after the integrator, since they don't affect what is shared between them
+    if (options[option].cameras.size() > 1)
+    {
+        std::cout << "\nSelect cameras to render, separated by spaces, or leave empty to render all: ";
+        std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+        std::string line;
+        std::getline(std::cin, line);
+
+        std::vector<size_t> cameras;
+        std::stringstream ss(line);
+        size_t c;
+        while (ss >> c)
         {
-            options[option].photon_map = false;
+            if (c < options[option].cameras.size()) cameras.push_back(c);
         }
+        if (!cameras.empty()) options[option].cameras = cameras;
+    }
+
+    switch (a)
+    {
+        case 'm': options[option].integrator = Option::IntegratorType::PHOTON_MAPPER; break;
+        case 'b': options[option].integrator = Option::IntegratorType::BDPT; break;
+        case 'v': options[option].integrator = Option::IntegratorType::VCM; break;
+        case 'l': options[option].integrator = Option::IntegratorType::MLT; break;
+        default:  options[option].integrator = Option::IntegratorType::PATH_TRACER; break;
     }
 
     return options[option];
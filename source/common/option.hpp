@@ -6,15 +6,28 @@
 
 struct Option
 {
-    Option(const std::filesystem::path& path, const std::string& camera, int camera_idx, bool photon_map)
-        : path(path), camera(camera), camera_idx(camera_idx), photon_map(photon_map){ }
+    enum class IntegratorType
+    {
+        PATH_TRACER,
+        PHOTON_MAPPER,
+        BDPT,
+        VCM,
+        MLT
+    };
+
+    Option(const std::filesystem::path& path, const std::string& camera, const std::vector<size_t>& cameras, bool photon_map)
+        : path(path), camera(camera), cameras(cameras), photon_map(photon_map), integrator(IntegratorType::PATH_TRACER) { }
 
     std::filesystem::path path;
     std::string camera;
-    int camera_idx;
-    bool photon_map;
+    std::vector<size_t> cameras; // indices of the cameras to render, which share the scene and integrator
+    bool photon_map; // scene has photon map settings
+    IntegratorType integrator;
 };
 
 std::vector<Option> availible(std::filesystem::path path);
 
+// Integrator from its name, e.g. "photon_mapper", or the letter used when choosing it in the terminal. Throws if unknown.
+Option::IntegratorType parseIntegrator(std::string name);
+
 Option getOption(std::vector<Option>& options);
@@ -0,0 +1,62 @@
+/*************************************************************
+Non-owning view of a contiguous sequence of objects, a minimal
+stand-in for C++20 std::span.
+**************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <type_traits>
+
+template <class T>
+class Span
+{
+public:
+    Span() : data_(nullptr), size_(0) { }
+    Span(T* data, size_t size) : data_(data), size_(size) { }
+
+    template <class U, class = std::enable_if_t<std::is_convertible_v<U(*)[], T(*)[]>>>
+    Span(std::vector<U>& v) : data_(v.data()), size_(v.size()) { }
+
+    template <class U, class = std::enable_if_t<std::is_convertible_v<const U(*)[], T(*)[]>>>
+    Span(const std::vector<U>& v) : data_(v.data()), size_(v.size()) { }
+
+    T& operator[](size_t i) const
+    {
+        return data_[i];
+    }
+
+    T* begin() const
+    {
+        return data_;
+    }
+
+    T* end() const
+    {
+        return data_ + size_;
+    }
+
+    T* data() const
+    {
+        return data_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    Span subspan(size_t offset, size_t count) const
+    {
+        return Span(data_ + offset, count);
+    }
+
+private:
+    T* data_;
+    size_t size_;
+};
@@ -0,0 +1,36 @@
+#include "thread-counters.hpp"
+
+#include <deque>
+#include <mutex>
+
+namespace
+{
+    // Elements of a deque are never moved, so threads can keep references to their counters
+    std::deque<Counters::Thread> threads;
+    std::mutex threads_mutex;
+}
+
+Counters::Thread& Counters::local()
+{
+    thread_local Thread* counters = []()
+    {
+        std::lock_guard<std::mutex> lock(threads_mutex);
+        return &threads.emplace_back();
+    }();
+    return *counters;
+}
+
+Counters::Totals Counters::sum()
+{
+    std::lock_guard<std::mutex> lock(threads_mutex);
+
+    Totals totals;
+    for (const auto& t : threads)
+    {
+        totals.pixels += t.pixels.load(std::memory_order_relaxed);
+        totals.samples += t.samples.load(std::memory_order_relaxed);
+        totals.rays += t.rays.load(std::memory_order_relaxed);
+        totals.shadow_rays += t.shadow_rays.load(std::memory_order_relaxed);
+    }
+    return totals;
+}
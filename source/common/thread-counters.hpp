@@ -0,0 +1,35 @@
+/*************************************************************************
+Statistics counters of each thread, padded to separate cache lines so that
+counting never writes to a cache line shared with another thread. Only the
+owning thread writes its counters, and readers sum them over all threads.
+**************************************************************************/
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+namespace Counters
+{
+    struct alignas(64) Thread
+    {
+        std::atomic<uint64_t> pixels = 0, samples = 0, rays = 0, shadow_rays = 0;
+    };
+
+    struct Totals
+    {
+        uint64_t pixels = 0, samples = 0, rays = 0, shadow_rays = 0;
+    };
+
+    // Counters of the calling thread, registered on first use
+    Thread& local();
+
+    // Snapshot of the sum over all threads
+    Totals sum();
+
+    // Plain load and store instead of a locked read-modify-write, since only the owner writes
+    inline void add(std::atomic<uint64_t>& counter, uint64_t n = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+}
@@ -0,0 +1,244 @@
+#include "thread-pool.hpp"
+
+#include <atomic>
+#include <memory>
+#include <algorithm>
+
+#include "numa.hpp"
+
+namespace
+{
+    thread_local bool pool_thread = false;
+    thread_local size_t pool_thread_idx = 0;
+}
+
+ThreadPool& ThreadPool::get()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+ThreadPool::~ThreadPool()
+{
+    join();
+}
+
+void ThreadPool::join()
+{
+    {
+        std::lock_guard<std::mutex> lock(m);
+        stop = true;
+    }
+    cv.notify_all();
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    threads.clear();
+    thread_tasks.clear();
+    stop = false;
+}
+
+void ThreadPool::resize(size_t num_threads, bool bind_to_nodes)
+{
+    if (threads.size() == num_threads && bound == bind_to_nodes) return;
+
+    // Threads keep the node they were bound to, and the nodes of bound threads depend on the number of 
+    // threads, so the threads are replaced instead of rebound
+    join();
+
+    std::lock_guard<std::mutex> lock(m);
+    bound = bind_to_nodes;
+    while (threads.size() < num_threads)
+    {
+        thread_tasks.emplace_back();
+        threads.emplace_back(&ThreadPool::workerThread, this, threads.size(), bind_to_nodes);
+    }
+}
+
+std::future<void> ThreadPool::submit(std::function<void()> task)
+{
+    auto packaged = std::make_shared<std::packaged_task<void()>>(std::move(task));
+    std::future<void> future = packaged->get_future();
+    {
+        std::lock_guard<std::mutex> lock(m);
+        tasks.emplace_back([packaged]() { (*packaged)(); });
+    }
+    cv.notify_one();
+    return future;
+}
+
+std::future<void> ThreadPool::forEachWorker(std::function<void(size_t)> f)
+{
+    return queueGroup(std::move(f), false);
+}
+
+std::future<void> ThreadPool::forEachThread(std::function<void(size_t)> f)
+{
+    return queueGroup(std::move(f), true);
+}
+
+std::future<void> ThreadPool::queueGroup(std::function<void(size_t)> f, bool on_threads)
+{
+    struct Group
+    {
+        std::function<void(size_t)> f;
+        std::atomic_size_t remaining;
+        std::promise<void> done;
+        std::exception_ptr exception;
+        std::mutex exception_mutex;
+    };
+
+    size_t num_workers = std::max(size(), size_t(1));
+
+    auto group = std::make_shared<Group>();
+    group->f = std::move(f);
+    group->remaining = num_workers;
+    std::future<void> future = group->done.get_future();
+
+    {
+        std::lock_guard<std::mutex> lock(m);
+        for (size_t worker = 0; worker < num_workers; worker++)
+        {
+            auto& queue = on_threads && !threads.empty() ? thread_tasks[worker] : tasks;
+            queue.emplace_back([group, worker]()
+            {
+                try
+                {
+                    group->f(worker);
+                }
+                catch (...)
+                {
+                    std::lock_guard<std::mutex> lock(group->exception_mutex);
+                    if (!group->exception) group->exception = std::current_exception();
+                }
+
+                if (--group->remaining == 0)
+                {
+                    if (group->exception)
+                        group->done.set_exception(group->exception);
+                    else
+                        group->done.set_value();
+                }
+            });
+        }
+    }
+    cv.notify_all();
+
+    // Without threads, the calling thread does the work
+    if (threads.empty())
+    {
+        while (runQueuedTask());
+    }
+    return future;
+}
+
+void ThreadPool::wait(std::future<void>& future)
+{
+    if (pool_thread)
+    {
+        while (future.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+        {
+            if (!runQueuedTask())
+            {
+                future.wait_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+    future.get();
+}
+
+void ThreadPool::parallelFor(size_t n, size_t chunk_size, std::function<void(size_t, size_t, size_t)> f)
+{
+    // Shared with the helper tasks, which may start after the call has returned and then find no chunks
+    struct State
+    {
+        std::function<void(size_t, size_t, size_t)> f;
+        size_t n, chunk_size;
+        std::atomic_size_t next = 0, done = 0;
+        std::mutex m;
+        std::condition_variable cv;
+
+        void work(size_t participant)
+        {
+            size_t begin;
+            while ((begin = next.fetch_add(chunk_size)) < n)
+            {
+                size_t end = std::min(begin + chunk_size, n);
+                f(begin, end, participant);
+                if (done.fetch_add(end - begin) + (end - begin) == n)
+                {
+                    std::lock_guard<std::mutex> lock(m);
+                    cv.notify_all();
+                }
+            }
+        }
+    };
+
+    if (n == 0) return;
+
+    auto state = std::make_shared<State>();
+    state->f = std::move(f);
+    state->n = n;
+    state->chunk_size = std::max(chunk_size, size_t(1));
+
+    size_t num_helpers = std::min(size(), (n - 1) / state->chunk_size);
+    {
+        std::lock_guard<std::mutex> lock(m);
+        for (size_t i = 1; i <= num_helpers; i++)
+        {
+            tasks.emplace_back([state, i]() { state->work(i); });
+        }
+    }
+    cv.notify_all();
+
+    state->work(0);
+
+    std::unique_lock<std::mutex> lock(state->m);
+    state->cv.wait(lock, [&state]() { return state->done == state->n; });
+}
+
+// Tasks of the thread itself are taken first. Must hold the lock.
+bool ThreadPool::popTask(size_t thread, std::function<void()>& task)
+{
+    auto& queue = pool_thread && !thread_tasks[thread].empty() ? thread_tasks[thread] : tasks;
+    if (queue.empty()) return false;
+    task = std::move(queue.front());
+    queue.pop_front();
+    return true;
+}
+
+bool ThreadPool::runQueuedTask()
+{
+    std::function<void()> task;
+    {
+        std::lock_guard<std::mutex> lock(m);
+        if (!popTask(pool_thread_idx, task)) return false;
+    }
+    task();
+    return true;
+}
+
+void ThreadPool::workerThread(size_t thread, bool bind_to_nodes)
+{
+    pool_thread = true;
+    pool_thread_idx = thread;
+
+    if (bind_to_nodes)
+    {
+        std::unique_lock<std::mutex> lock(m);
+        NUMA::bindThread(thread * NUMA::numNodes() / std::max(threads.size(), thread + 1));
+    }
+
+    while (true)
+    {
+        std::function<void()> task;
+        {
+            std::unique_lock<std::mutex> lock(m);
+            cv.wait(lock, [this, thread]() { return stop || !tasks.empty() || !thread_tasks[thread].empty(); });
+            if (!popTask(thread, task)) return;
+        }
+        task();
+    }
+}
@@ -0,0 +1,80 @@
+/*************************************************************************
+Process-wide pool of worker threads, created once and shared by all render
+phases, i.e. BVH construction, photon emission, photon map construction
+and rendering. Phases queue tasks instead of spawning their own threads,
+and may overlap since queued tasks don't have to wait for each other.
+**************************************************************************/
+
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+
+class ThreadPool
+{
+public:
+    static ThreadPool& get();
+
+    ~ThreadPool();
+
+    // Starts the threads, the pool has no threads until this is called. Bound threads are split evenly between
+    // the NUMA nodes in contiguous blocks, so that thread i is on node i * nodes / threads. If the number of 
+    // threads or the binding differs from an earlier call, the threads finish the queued tasks and are replaced,
+    // so this must not be called from a pool thread or while tasks are running.
+    void resize(size_t num_threads, bool bind_to_nodes = false);
+
+    size_t size() const
+    {
+        return threads.size();
+    }
+
+    std::future<void> submit(std::function<void()> task);
+
+    // Queues f(worker) for each worker index in [0, size()). The future is ready when all of them have returned.
+    std::future<void> forEachWorker(std::function<void(size_t)> f);
+
+    // Like forEachWorker, but f(thread) runs on the pool thread with that index, which tasks on bound threads
+    // can use to work on data that was first touched by the same thread
+    std::future<void> forEachThread(std::function<void(size_t)> f);
+
+    void run(std::function<void(size_t)> f)
+    {
+        std::future<void> done = forEachWorker(std::move(f));
+        wait(done);
+    }
+
+    // Pool threads run queued tasks while they wait, so that tasks can wait for other tasks
+    void wait(std::future<void>& future);
+
+    // Runs f(begin, end, participant) for chunks of [0, n) on the calling thread and on the pool threads that are
+    // free. Returns when all chunks are done without waiting for threads that are busy with other tasks, e.g. the
+    // pass of the next camera. participant is less than size() + 1 and differs between concurrent calls of f.
+    void parallelFor(size_t n, size_t chunk_size, std::function<void(size_t, size_t, size_t)> f);
+
+private:
+    ThreadPool() { }
+
+    std::future<void> queueGroup(std::function<void(size_t)> f, bool on_threads);
+
+    bool popTask(size_t thread, std::function<void()>& task);
+    bool runQueuedTask();
+    void workerThread(size_t thread, bool bind_to_nodes);
+
+    // Lets the threads finish the queued tasks and joins them
+    void join();
+
+    std::vector<std::thread> threads;
+    std::deque<std::function<void()>> tasks;
+
+    // Tasks that must run on a specific thread. References to elements of a deque stay valid when it grows.
+    std::deque<std::deque<std::function<void()>>> thread_tasks;
+    std::mutex m;
+    std::condition_variable cv;
+    bool stop = false;
+    bool bound = false;
+};
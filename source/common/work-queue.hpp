@@ -1,61 +1,161 @@
-
-/***************************************************
-A thread safe queue that can be used to store work 
-that different threads can un-queue concurrently.
-***************************************************/
+/*************************************************************************
+A work-stealing queue for work that is known up front. The items are split
+into one contiguous range per worker, which each worker takes items from
+the front of. Workers that run out of items steal the back half of the
+range of another worker. Ranges are packed in single atomics, so taking
+and stealing work are both lock-free.
+**************************************************************************/
 
 #pragma once
 
-#include <queue>
-#include <mutex>
 #include <vector>
+#include <atomic>
+#include <chrono>
+#include <algorithm>
+#include <cstdint>
 
 template <class T>
 class WorkQueue
 {
 public:
-    WorkQueue(const std::vector<T> items) : m()
+    struct Stats
+    {
+        size_t steals = 0, failed_steals = 0;
+        double idle_fraction = 0.0; // of the total thread time since the queue was created
+    };
+
+    WorkQueue(const std::vector<T>& items, size_t num_workers)
+        : items(items), workers(std::max(num_workers, size_t(1))), start(std::chrono::steady_clock::now())
     {
-        original_size = items.size();
-        for (const auto& item : items)
+        for (size_t w = 0; w < workers.size(); w++)
         {
-            queue.push(item);
+            workers[w].range = pack(w * items.size() / workers.size(), (w + 1) * items.size() / workers.size());
         }
     }
 
-    bool getWork(T& item)
+    // Each worker index must only be used by one thread, and workers should call this until it returns false
+    bool getWork(size_t worker, T& item)
     {
-        std::unique_lock<std::mutex> lock(m);
+        Worker& self = workers[worker % workers.size()];
+
+        uint32_t i;
+        if (popFront(self, i))
+        {
+            item = items[i];
+            num_taken++;
+            return true;
+        }
+
+        for (size_t k = 1; k < workers.size(); k++)
+        {
+            uint32_t begin, end;
+            if (stealBack(workers[(worker + k) % workers.size()], begin, end))
+            {
+                self.steals++;
+                self.range = pack(begin + 1, end);
+                item = items[begin];
+                num_taken++;
+                return true;
+            }
+            self.failed_steals++;
+        }
 
-        bool empty = queue.empty();
-        if (!empty)
+        if (!self.done)
         {
-            item = queue.front();
-            queue.pop();
+            self.done = true;
+            self.finish = std::chrono::steady_clock::now();
         }
-        lock.unlock();
+        return false;
+    }
 
-        return !empty;
+    // True if all items have been taken, but not necessarily processed
+    bool empty() const
+    {
+        return num_taken == items.size();
     }
 
-    bool empty()
+    double progress() const
     {
-        std::unique_lock<std::mutex> lock(m);
-        bool empty = queue.empty();
-        lock.unlock();
-        return empty;
+        return items.empty() ? 100.0 : static_cast<double>(num_taken) * 100.0 / items.size();
     }
 
-    double progress()
+    // Only valid after all workers are done
+    Stats stats() const
     {
-        std::unique_lock<std::mutex> lock(m);
-        double p = static_cast<double>(original_size - queue.size()) * 100.0 / original_size;
-        lock.unlock();
-        return p;
+        Stats stats;
+        auto last_finish = start;
+        for (const auto& w : workers)
+        {
+            stats.steals += w.steals;
+            stats.failed_steals += w.failed_steals;
+            if (w.done) last_finish = std::max(last_finish, w.finish);
+        }
+
+        double total = std::chrono::duration<double>(last_finish - start).count() * workers.size();
+        double idle = 0.0;
+        for (const auto& w : workers)
+        {
+            if (w.done) idle += std::chrono::duration<double>(last_finish - w.finish).count();
+        }
+        stats.idle_fraction = total > 0.0 ? idle / total : 0.0;
+        return stats;
     }
 
 private:
-    size_t original_size;
-    std::queue<T> queue;
-    mutable std::mutex m;
-};
\ No newline at end of file
+    // Padded to avoid false sharing between workers
+    struct alignas(64) Worker
+    {
+        std::atomic<uint64_t> range = 0;
+
+        // Only written by the owner
+        size_t steals = 0, failed_steals = 0;
+        bool done = false;
+        std::chrono::steady_clock::time_point finish;
+    };
+
+    static uint64_t pack(uint64_t begin, uint64_t end)
+    {
+        return (begin << 32) | end;
+    }
+
+    static void unpack(uint64_t range, uint32_t& begin, uint32_t& end)
+    {
+        begin = static_cast<uint32_t>(range >> 32);
+        end = static_cast<uint32_t>(range);
+    }
+
+    static bool popFront(Worker& worker, uint32_t& i)
+    {
+        uint64_t range = worker.range;
+        uint32_t begin, end;
+        do
+        {
+            unpack(range, begin, end);
+            if (begin >= end) return false;
+        } while (!worker.range.compare_exchange_weak(range, pack(begin + 1, end)));
+
+        i = begin;
+        return true;
+    }
+
+    static bool stealBack(Worker& victim, uint32_t& stolen_begin, uint32_t& stolen_end)
+    {
+        uint64_t range = victim.range;
+        uint32_t begin, end, half;
+        do
+        {
+            unpack(range, begin, end);
+            if (begin >= end) return false;
+            half = (end - begin + 1) / 2;
+        } while (!victim.range.compare_exchange_weak(range, pack(begin, end - half)));
+
+        stolen_begin = end - half;
+        stolen_end = end;
+        return true;
+    }
+
+    const std::vector<T> items;
+    std::vector<Worker> workers;
+    std::atomic_size_t num_taken = 0;
+    const std::chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,227 @@
+#include "sd-tree.hpp"
+
+#include <stack>
+
+#include <glm/glm.hpp>
+
+#include "../common/util.hpp"
+#include "../common/constants.hpp"
+#include "../random/random.hpp"
+
+void DTree::record(const glm::dvec3& direction, double radiance)
+{
+    num_samples++;
+
+    if (!(radiance > 0.0) || !std::isfinite(radiance)) return;
+
+    glm::dvec2 p = toSquare(direction);
+    uint32_t node_idx = 0;
+    while (true)
+    {
+        uint8_t q = quadrant(p);
+        nodes[node_idx].sums[q].add(radiance);
+        if (!nodes[node_idx].children[q]) return;
+        node_idx = nodes[node_idx].children[q];
+    }
+}
+
+glm::dvec3 DTree::sample() const
+{
+    glm::dvec2 origin(0.0);
+    double size = 1.0;
+    uint32_t node_idx = 0;
+
+    while (true)
+    {
+        const auto& sums = nodes[node_idx].sums;
+        double total = sums[0] + sums[1] + sums[2] + sums[3];
+
+        if (total <= 0.0)
+        {
+            break;
+        }
+
+        double r = Random::unit() * total;
+        uint8_t q = 0;
+        for (; q < 3; q++)
+        {
+            if (r < sums[q]) break;
+            r -= sums[q];
+        }
+
+        size *= 0.5;
+        origin += glm::dvec2(q & 1, q >> 1) * size;
+
+        if (!nodes[node_idx].children[q]) break;
+        node_idx = nodes[node_idx].children[q];
+    }
+    return fromSquare(origin + glm::dvec2(Random::unit(), Random::unit()) * size);
+}
+
+double DTree::pdf(const glm::dvec3& direction) const
+{
+    glm::dvec2 p = toSquare(direction);
+    double pdf = C::INV_PI / 4.0;
+    uint32_t node_idx = 0;
+
+    while (true)
+    {
+        const auto& sums = nodes[node_idx].sums;
+        double total = sums[0] + sums[1] + sums[2] + sums[3];
+
+        if (total <= 0.0) return pdf;
+
+        uint8_t q = quadrant(p);
+        pdf *= 4.0 * sums[q] / total;
+
+        if (!nodes[node_idx].children[q]) return pdf;
+        node_idx = nodes[node_idx].children[q];
+    }
+}
+
+void DTree::refine(const DTree& other, double threshold)
+{
+    nodes = std::vector<Node>(1);
+    num_samples = 0;
+
+    double total = other.energy();
+    if (total <= 0.0) return;
+
+    struct Entry
+    {
+        uint32_t node, other_node; // other_node is 0 if the region is a leaf in other
+        double fraction;           // fraction of the total energy in region
+        uint8_t depth;
+    };
+
+    std::stack<Entry> to_visit;
+    to_visit.push({ 0, 0, 1.0, 1 });
+
+    bool root = true;
+    while (!to_visit.empty())
+    {
+        Entry e = to_visit.top();
+        to_visit.pop();
+
+        for (uint8_t q = 0; q < 4; q++)
+        {
+            bool other_inner = root || e.other_node;
+
+            // Energy of leaf quadrants in other is assumed to be uniformly distributed
+            double fraction = other_inner ? other.nodes[e.other_node].sums[q] / total : e.fraction / 4.0;
+
+            if (fraction > threshold && e.depth < max_depth)
+            {
+                uint32_t child = static_cast<uint32_t>(nodes.size());
+                nodes[e.node].children[q] = child;
+                nodes.emplace_back();
+                to_visit.push({ child, other_inner ? other.nodes[e.other_node].children[q] : 0, fraction, uint8_t(e.depth + 1) });
+            }
+        }
+        root = false;
+    }
+}
+
+double DTree::energy() const
+{
+    const auto& sums = nodes[0].sums;
+    return sums[0] + sums[1] + sums[2] + sums[3];
+}
+
+glm::dvec2 DTree::toSquare(const glm::dvec3& direction)
+{
+    double cos_theta = glm::clamp(direction.z, -1.0, 1.0);
+    double phi = std::atan2(direction.y, direction.x);
+    if (phi < 0.0) phi += C::TWO_PI;
+
+    glm::dvec2 p((cos_theta + 1.0) / 2.0, phi / C::TWO_PI);
+    return glm::clamp(p, 0.0, std::nextafter(1.0, 0.0));
+}
+
+glm::dvec3 DTree::fromSquare(const glm::dvec2& p)
+{
+    double cos_theta = 2.0 * p.x - 1.0;
+    double sin_theta = std::sqrt(std::max(0.0, 1.0 - cos_theta * cos_theta));
+    double phi = C::TWO_PI * p.y;
+    return glm::dvec3(sin_theta * std::cos(phi), sin_theta * std::sin(phi), cos_theta);
+}
+
+// Returns the quadrant of p in [0,1)^2 and transforms p to the [0,1)^2 space of that quadrant
+uint8_t DTree::quadrant(glm::dvec2& p)
+{
+    uint8_t q = (p.x >= 0.5 ? 1 : 0) | (p.y >= 0.5 ? 2 : 0);
+    p = p * 2.0 - glm::dvec2(q & 1, q >> 1);
+    return q;
+}
+
+SDTree::SDTree(const BoundingBox& BB, const nlohmann::json& j) : BB(BB), nodes(1), dtrees(1)
+{
+    spatial_threshold = getOptional(j, "spatial_threshold", 12000);
+    directional_threshold = getOptional(j, "directional_threshold", 0.01);
+}
+
+DTreeWrapper& SDTree::dTree(const glm::dvec3& position)
+{
+    glm::dvec3 p = glm::clamp((position - BB.min) / BB.dimensions(), 0.0, std::nextafter(1.0, 0.0));
+
+    uint32_t node_idx = 0;
+    while (!nodes[node_idx].leaf())
+    {
+        const auto& node = nodes[node_idx];
+        double& x = p[node.axis];
+        uint8_t child = x >= 0.5 ? 1 : 0;
+        x = x * 2.0 - child;
+        node_idx = node.children[child];
+    }
+    return dtrees[nodes[node_idx].dtree];
+}
+
+void SDTree::refine()
+{
+    size_t num_leaves = nodes.size();
+    for (uint32_t i = 0; i < num_leaves; i++)
+    {
+        if (nodes[i].leaf()) subdivide(i);
+    }
+
+    for (auto& dtree : dtrees)
+    {
+        dtree.sampling = dtree.building;
+        dtree.building.refine(dtree.sampling, directional_threshold);
+    }
+}
+
+void SDTree::subdivide(uint32_t node_idx)
+{
+    if (dtrees[nodes[node_idx].dtree].building.numSamples() <= spatial_threshold)
+    {
+        return;
+    }
+
+    // The directional distribution of the parent is the best guess for the children
+    uint32_t dtree = nodes[node_idx].dtree;
+    dtrees[dtree].building.scaleNumSamples(0.5);
+
+    uint8_t child_axis = (nodes[node_idx].axis + 1) % 3;
+    for (uint8_t c = 0; c < 2; c++)
+    {
+        uint32_t child = static_cast<uint32_t>(nodes.size());
+        nodes[node_idx].children[c] = child;
+        nodes.emplace_back();
+        nodes[child].axis = child_axis;
+        if (c == 0)
+        {
+            nodes[child].dtree = dtree;
+        }
+        else
+        {
+            nodes[child].dtree = static_cast<uint32_t>(dtrees.size());
+            dtrees.push_back(dtrees[dtree]);
+        }
+    }
+
+    for (uint8_t c = 0; c < 2; c++)
+    {
+        subdivide(nodes[node_idx].children[c]);
+    }
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <vector>
+#include <array>
+#include <atomic>
+
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+
+#include <nlohmann/json.hpp>
+
+#include "../common/bounding-box.hpp"
+#include "../common/atomic-double.hpp"
+
+/*********************************************************************************
+Spatial-directional tree used for path guiding, based on "Practical Path Guiding
+for Efficient Light-Transport Simulation" by Müller et al. A binary tree subdivides
+the scene spatially, and each leaf holds quadtrees over the sphere of directions
+that learn the distribution of incident radiance in that region.
+
+Directions are mapped to the unit square with the area-preserving cylindrical
+mapping (cos(theta), phi), which makes the solid angle pdf = square pdf / 4pi.
+**********************************************************************************/
+
+class DTree
+{
+public:
+    DTree() : nodes(1), num_samples(0) { }
+
+    DTree(const DTree& other)
+        : nodes(other.nodes), num_samples(other.num_samples.load()) { }
+
+    DTree& operator=(const DTree& other)
+    {
+        nodes = other.nodes;
+        num_samples = other.num_samples.load();
+        return *this;
+    }
+
+    // Thread safe
+    void record(const glm::dvec3& direction, double radiance);
+
+    glm::dvec3 sample() const;
+    double pdf(const glm::dvec3& direction) const;
+
+    // Rebuilds this tree with the structure of other subdivided such that no leaf quadrant
+    // holds more than threshold of the total energy of other. All energies are reset.
+    void refine(const DTree& other, double threshold);
+
+    double energy() const;
+
+    size_t numSamples() const
+    {
+        return num_samples;
+    }
+
+    void scaleNumSamples(double factor)
+    {
+        num_samples = static_cast<size_t>(num_samples * factor);
+    }
+
+private:
+    struct Node
+    {
+        Node() : children{ 0, 0, 0, 0 } { }
+
+        std::array<AtomicDouble, 4> sums;
+        std::array<uint32_t, 4> children; // 0 if quadrant is a leaf
+    };
+
+    static glm::dvec2 toSquare(const glm::dvec3& direction);
+    static glm::dvec3 fromSquare(const glm::dvec2& p);
+    static uint8_t quadrant(glm::dvec2& p);
+
+    std::vector<Node> nodes;
+    std::atomic_size_t num_samples;
+
+    const uint8_t max_depth = 20;
+};
+
+struct DTreeWrapper
+{
+    DTree building, sampling;
+};
+
+class SDTree
+{
+public:
+    SDTree(const BoundingBox& BB, const nlohmann::json& j);
+
+    DTreeWrapper& dTree(const glm::dvec3& position);
+
+    // Subdivides the spatial tree and directional quadtrees based on the data recorded
+    // since the last refinement. The recorded data is then used for sampling.
+    void refine();
+
+private:
+    struct Node
+    {
+        Node() : axis(0), children{ 0, 0 }, dtree(0) { }
+
+        bool leaf() const
+        {
+            return children[0] == 0;
+        }
+
+        uint8_t axis;
+        std::array<uint32_t, 2> children;
+        uint32_t dtree;
+    };
+
+    void subdivide(uint32_t node_idx);
+
+    BoundingBox BB;
+    std::vector<Node> nodes;
+    std::vector<DTreeWrapper> dtrees;
+
+    size_t spatial_threshold;
+    double directional_threshold;
+};
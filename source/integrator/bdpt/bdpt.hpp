@@ -0,0 +1,18 @@
+#pragma once
+
+#include <nlohmann/json.hpp>
+
+#include "../vcm/vcm.hpp"
+
+/*************************************************************************************
+Bidirectional path tracing, based on "Robust Monte Carlo Methods for Light Transport
+Simulation" by Veach. Vertex connection and merging without merging is bidirectional
+path tracing with all connection strategies combined with multiple importance sampling,
+so this shares the implementation of VCM.
+**************************************************************************************/
+
+class BDPT : public VCM
+{
+public:
+    BDPT(const nlohmann::json& j) : VCM(j, false) { }
+};
@@ -4,8 +4,12 @@
 #include <thread>
 
 #include <glm/gtx/norm.hpp>
+#include <glm/gtx/component_wise.hpp>
 
 #include "../common/util.hpp"
+#include "../common/thread-pool.hpp"
+#include "../common/numa.hpp"
+#include "../common/thread-counters.hpp"
 #include "../common/constexpr-math.hpp"
 #include "../common/constants.hpp"
 #include "../random/random.hpp"
@@ -13,14 +17,45 @@
 #include "../surface/surface.hpp"
 #include "../ray/interaction.hpp"
 
-Integrator::Integrator(const nlohmann::json &j) : scene(j)
+namespace
+{
+    // Starts the shared thread pool before the scene is constructed, since it is also used to build the BVH
+    size_t startThreadPool(const nlohmann::json &j)
+    {
+        int threads = getOptional(j, "num_render_threads", -1);
+        size_t max_threads = std::thread::hardware_concurrency();
+        size_t num_threads = (threads < 1 || size_t(threads) > max_threads) ? max_threads : threads;
+
+        bool numa = j.find("numa") != j.end();
+        ThreadPool::get().resize(num_threads, numa);
+        std::cout << "\nThreads used for rendering: " << num_threads << std::endl;
+        if (numa)
+        {
+            std::cout << "NUMA nodes: " << NUMA::numNodes() << std::endl;
+        }
+        return num_threads;
+    }
+}
+
+Integrator::Integrator(const nlohmann::json &j) : num_threads(startThreadPool(j)), shared_scene(Scene::load(j)), scene(*shared_scene)
 {
-    int threads = getOptional(j, "num_render_threads", -1);
     naive = getOptional(j, "naive", false);
+    numa = j.find("numa") != j.end();
+    deterministic = j.find("seed") != j.end();
+    seed = getOptional<uint64_t>(j, "seed", 0);
+
+    adjoint_rr = j.find("adjoint_rr") != j.end();
+    nlohmann::json rr = getOptional(j, "adjoint_rr", nlohmann::json::object());
+    window_size = std::max(getOptional(rr, "window_size", 5.0), 1.0);
+    max_splits = std::max(getOptional(rr, "max_splits", 8), 1);
+    num_estimate_passes = std::max(getOptional(rr, "estimate_passes", 1), 1);
 
-    size_t max_threads = std::thread::hardware_concurrency();
-    num_threads = (threads < 1 || threads > max_threads) ? max_threads : threads;
-    std::cout << "\nThreads used for rendering: " << num_threads << std::endl;
+    restir = j.find("restir") != j.end();
+    nlohmann::json r = getOptional(j, "restir", nlohmann::json::object());
+    num_candidates = std::max(getOptional<size_t>(r, "candidates", 8), size_t(1));
+    spatial_reuse = restir && getOptional(r, "spatial_reuse", false);
+    num_reuse_neighbors = getOptional<size_t>(r, "neighbors", 3);
+    reuse_radius = std::max(getOptional(r, "radius", 10), 1);
 }
 
 /*****************************************************************************
@@ -29,47 +64,193 @@ samples this direct contribution. It must be attenuated by the BRDF later.
 ******************************************************************************/
 glm::dvec3 Integrator::sampleDirect(const Interaction& interaction) const
 {
-    // Pick one light source and divide with probability of picking light source
-    if (!scene.emissives.empty())
+    if (scene.emissives.empty())
+    {
+        return glm::dvec3(0.0);
+    }
+
+    if (restir)
     {
-        const auto& light = scene.emissives[Random::get<size_t>(0, scene.emissives.size() - 1)];
+        return sampleDirectReservoir(interaction);
+    }
 
-        glm::dvec3 light_pos = light->operator()(Random::unit(), Random::unit());
-        Ray shadow_ray(interaction.position + interaction.normal * C::EPSILON, light_pos);
+    LightSample sample = sampleLight();
+    glm::dvec3 direct = unshadowedDirect(interaction.position, interaction.normal, sample);
 
-        double cos_light_theta = glm::dot(-shadow_ray.direction, light->normal(light_pos));
+    if (direct == glm::dvec3(0.0) || !visible(interaction.position, interaction.normal, sample))
+    {
+        return glm::dvec3(0.0);
+    }
 
-        if (cos_light_theta <= 0.0)
-        {
-            return glm::dvec3(0.0);
-        }
+    // Divide with the probability of picking the light source and the point on it
+    return direct * sample.light->area() * static_cast<double>(scene.emissives.size());
+}
 
-        double cos_theta = glm::dot(shadow_ray.direction, interaction.normal);
+Integrator::LightSample Integrator::sampleLight() const
+{
+    LightSample sample;
+    sample.light = scene.emissives[Random::get<size_t>(0, scene.emissives.size() - 1)].get();
+    sample.position = sample.light->operator()(Random::unit(), Random::unit());
+    return sample;
+}
 
-        if (cos_theta <= 0)
-        {
-            return glm::dvec3(0.0);
-        }
+glm::dvec3 Integrator::unshadowedDirect(const glm::dvec3& position, const glm::dvec3& normal, const LightSample& sample) const
+{
+    Ray shadow_ray(position + normal * C::EPSILON, sample.position);
+
+    double cos_light_theta = glm::dot(-shadow_ray.direction, sample.light->normal(sample.position));
+    double cos_theta = glm::dot(shadow_ray.direction, normal);
+
+    if (cos_light_theta <= 0.0 || cos_theta <= 0.0)
+    {
+        return glm::dvec3(0.0);
+    }
+
+    // Transforms the area measure on the light to the solid angle measure at the diffuse point
+    double t = cos_light_theta / glm::distance2(shadow_ray.start, sample.position);
+
+    return sample.light->material->emittance * t * cos_theta;
+}
+
+bool Integrator::visible(const glm::dvec3& position, const glm::dvec3& normal, const LightSample& sample) const
+{
+    Counters::add(Counters::local().shadow_rays);
+
+    Ray shadow_ray(position + normal * C::EPSILON, sample.position);
+    Intersection shadow_intersection = scene.intersect(shadow_ray);
+
+    return shadow_intersection && glm::distance2(shadow_ray(shadow_intersection.t), sample.position) <= pow2(C::EPSILON);
+}
+
+bool Integrator::Reservoir::update(const LightSample& candidate, double weight, double count)
+{
+    weight_sum += weight;
+    M += count;
+    if (weight > 0.0 && Random::trial(weight / weight_sum))
+    {
+        sample = candidate;
+        return true;
+    }
+    return false;
+}
+
+/*************************************************************************************
+Direct light by resampled importance sampling, based on "Spatiotemporal Reservoir 
+Resampling for Real-Time Ray Tracing with Dynamic Direct Lighting" by Bitterli et al.
+Candidates are drawn with the usual light sampling and one of them is kept with 
+probability proportional to the luminance of its unshadowed contribution, so only 
+the kept candidate needs a shadow ray.
+
+With spatial reuse, the reservoirs of the primary hits of random neighboring pixels
+from the previous pass are combined with the reservoir of a primary hit. The weights
+are normalized by the number of candidates of the reservoirs whose surface points 
+could have produced the selected sample, which keeps the estimate unbiased.
+**************************************************************************************/
+glm::dvec3 Integrator::sampleDirectReservoir(const Interaction& interaction) const
+{
+    const glm::dvec3& position = interaction.position;
+    const glm::dvec3& normal = interaction.normal;
+
+    auto target = [&](const glm::dvec3& p, const glm::dvec3& n, const LightSample& sample)
+    {
+        return glm::compAdd(unshadowedDirect(p, n, sample)) / 3.0;
+    };
+
+    double source_pdf = 1.0 / static_cast<double>(scene.emissives.size());
+
+    Reservoir reservoir;
+    for (size_t i = 0; i < num_candidates; i++)
+    {
+        LightSample candidate = sampleLight();
+        reservoir.update(candidate, target(position, normal, candidate) * candidate.light->area() / source_pdf);
+    }
+
+    if (reservoir.weight_sum > 0.0)
+    {
+        reservoir.W = reservoir.weight_sum / (reservoir.M * target(position, normal, reservoir.sample));
+    }
 
-        Intersection shadow_intersection = scene.intersect(shadow_ray);
+    const Ray& ray = interaction.ray;
+    if (spatial_reuse && ray.pixel >= 0)
+    {
+        pixel_reservoirs[ray.pixel] = { position, normal, reservoir };
 
-        if (shadow_intersection)
+        if (!previous_pixel_reservoirs.empty())
         {
-            glm::dvec3 position = shadow_ray(shadow_intersection.t);
+            const int width = static_cast<int>(camera_width), height = static_cast<int>(previous_pixel_reservoirs.size() / camera_width);
+            const int x = ray.pixel % width, y = ray.pixel / width;
+
+            Reservoir combined;
+            combined.update(reservoir.sample, reservoir.weight_sum, reservoir.M);
 
-            if (glm::distance2(position, light_pos) > pow2(C::EPSILON))
+            std::vector<const PixelReservoir*> used;
+            used.reserve(num_reuse_neighbors);
+            for (size_t i = 0; i < num_reuse_neighbors; i++)
             {
-                return glm::dvec3(0.0);
-            }
+                int u = std::clamp(x + Random::get(-reuse_radius, reuse_radius), 0, width - 1);
+                int v = std::clamp(y + Random::get(-reuse_radius, reuse_radius), 0, height - 1);
+
+                const PixelReservoir& neighbor = previous_pixel_reservoirs[v * width + u];
+                if (neighbor.reservoir.M == 0.0 || neighbor.reservoir.W == 0.0)
+                {
+                    continue;
+                }
 
-            // Factor to transform the PDF of sampling the point on the light (1/area) to 
-            // the solid angle PDF at the diffuse point that samples this direct contribution.
-            double t = light->area() * cos_light_theta / pow2(shadow_intersection.t);
+                const Reservoir& n = neighbor.reservoir;
+                combined.update(n.sample, target(position, normal, n.sample) * n.W * n.M, n.M);
+                used.push_back(&neighbor);
+            }
 
-            return light->material->emittance * t * cos_theta * static_cast<double>(scene.emissives.size());
+            double selected_target = combined.weight_sum > 0.0 ? target(position, normal, combined.sample) : 0.0;
+            if (selected_target > 0.0)
+            {
+                double Z = reservoir.M;
+                for (const auto* neighbor : used)
+                {
+                    if (target(neighbor->position, neighbor->normal, combined.sample) > 0.0)
+                    {
+                        Z += neighbor->reservoir.M;
+                    }
+                }
+                combined.W = combined.weight_sum / (Z * selected_target);
+            }
+            reservoir = combined;
         }
     }
-    return glm::dvec3(0.0);
+
+    if (reservoir.W == 0.0 || !visible(position, normal, reservoir.sample))
+    {
+        return glm::dvec3(0.0);
+    }
+
+    return unshadowedDirect(position, normal, reservoir.sample) * reservoir.W;
+}
+
+void Integrator::allocatePixelData(size_t width, size_t height)
+{
+    if (spatial_reuse)
+    {
+        camera_width = width;
+        pixel_reservoirs.assign(width * height, PixelReservoir());
+        previous_pixel_reservoirs.clear();
+    }
+}
+
+void Integrator::trainingPassDone()
+{
+    if (spatial_reuse)
+    {
+        previous_pixel_reservoirs = std::move(pixel_reservoirs);
+        pixel_reservoirs.assign(previous_pixel_reservoirs.size(), PixelReservoir());
+    }
+}
+
+void Integrator::sampleRays(Span<const Ray> rays, Span<glm::dvec3> radiance)
+{
+    for (size_t i = 0; i < rays.size(); i++)
+    {
+        radiance[i] = sampleRay(rays[i]);
+    }
 }
 
 bool Integrator::absorb(const Ray &ray, const Intersection &isect, double &survive) const
@@ -81,4 +262,51 @@ bool Integrator::absorb(const Ray &ray, const Intersection &isect, double &survi
     }
     survive = isect.surface->material->reflect_probability;
     return Random::trial(1.0 - survive);
+}
+
+/*************************************************************************************
+Adjoint-driven Russian roulette and splitting, based on "Adjoint-Driven Russian 
+Roulette and Splitting in Light Transport Simulation" by Vorba and Křivánek. The 
+expected contribution of the path is the path throughput times the radiance estimate
+at the interaction. Paths whose expected contribution falls below a weight window 
+around the pixel estimate are terminated with a probability that brings surviving 
+paths back to the window, and paths above the window are split.
+
+The pixel estimate itself is used as radiance estimate if the integrator can't provide 
+one, which reduces the window test to a test on the path throughput. The material 
+based roulette is used until the camera has a pixel estimate from an earlier pass.
+**************************************************************************************/
+size_t Integrator::rouletteAndSplit(const Intersection &isect, const Interaction &interaction, double &survive) const
+{
+    const Ray &ray = interaction.ray;
+
+    if (ray.pixel_estimate <= 0.0)
+    {
+        return absorb(ray, isect, survive) ? 0 : 1;
+    }
+
+    survive = 1.0;
+
+    double estimate = adjointEstimate(interaction);
+    if (estimate < 0.0) estimate = ray.pixel_estimate;
+
+    double ratio = ray.throughput * estimate / ray.pixel_estimate;
+    if (!std::isfinite(ratio))
+    {
+        return 1;
+    }
+
+    double lower = 2.0 / (1.0 + window_size);
+    double upper = lower * window_size;
+
+    if (ratio < lower)
+    {
+        survive = std::max(ratio, 1e-3);
+        return Random::trial(survive) ? 1 : 0;
+    }
+    else if (ratio > upper && ray.depth < max_ray_depth / 2)
+    {
+        return std::min(static_cast<size_t>(ratio / upper) + 1, max_splits);
+    }
+    return 1;
 }
\ No newline at end of file
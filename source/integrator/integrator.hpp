@@ -1,8 +1,15 @@
 #pragma once
 
+#include <atomic>
+#include <vector>
+#include <algorithm>
+
 #include <nlohmann/json.hpp>
 
 #include "../scene/scene.hpp"
+#include "../common/span.hpp"
+
+class Camera;
 
 class Integrator
 {
@@ -12,14 +19,117 @@ public:
     virtual ~Integrator() { }
 
     virtual glm::dvec3 sampleRay(Ray ray) = 0;
+
+    // Writes the radiance of each ray to the corresponding element of radiance. The rays are the 
+    // primary rays of a part of a bucket, and integrators may override this to process them in 
+    // another order. The default implementation calls sampleRay for each ray.
+    virtual void sampleRays(Span<const Ray> rays, Span<glm::dvec3> radiance);
+
+    // Integrators that distribute the samples over the image themselves return true. The camera then 
+    // calls sampleImage instead of sampleRays, which splats num_pixels * spp samples to the camera and 
+    // adds the number of pixels worth of samples taken to the pixel counters of the threads as it goes.
+    virtual bool samplesImage() const { return false; }
+    virtual void sampleImage(size_t) { }
+
     virtual glm::dvec3 sampleDirect(const Interaction& interaction) const;
+
+    // Called by the camera before it renders. The integrator may be shared by several cameras that render
+    // one after another, so this discards the pixel data of the previous camera.
+    void allocatePixelData(size_t width, size_t height);
     bool absorb(const Ray &ray, const Intersection &isect, double &survive) const;
 
+    // Returns the number of paths to continue with from the interaction, 0 if absorbed
+    size_t rouletteAndSplit(const Intersection &isect, const Interaction &interaction, double &survive) const;
+
+    // Coarse estimate of the radiance leaving the interaction towards the ray, negative if unknown
+    virtual double adjointEstimate(const Interaction &) const { return -1.0; }
+
+    // Number of progressive passes that the camera should render before the final pass.
+    // trainingPassDone() is called after each of them, and the images are discarded.
+    virtual size_t numTrainingPasses() const
+    {
+        return std::max(adjoint_rr ? num_estimate_passes : 0, spatial_reuse ? size_t(1) : size_t(0));
+    }
+    virtual void trainingPassDone();
+
+    // True if radiance is splatted to the camera, which is only added to the pixels after each pass
+    virtual bool splatsToCamera() const { return samplesImage(); }
+
+    // True if several cameras can render with the integrator at the same time, which requires that it has
+    // no per-camera state and doesn't use the camera pointer while sampling
+    virtual bool rendersConcurrentCameras() const
+    {
+        return !samplesImage() && !spatial_reuse && numTrainingPasses() == 0;
+    }
+
     bool naive;
     size_t num_threads;
-    Scene scene;
+
+    // Pool threads are bound to NUMA nodes, and each node renders the same image tiles in every pass
+    bool numa;
+
+    // Sample streams are seeded from seed, pixel and sample indices if deterministic
+    bool deterministic;
+    uint64_t seed;
+
+    // Adjoint-driven Russian roulette and splitting
+    bool adjoint_rr;
+    double window_size;
+    size_t max_splits, num_estimate_passes;
+
+    // Reservoir resampling of direct light samples
+    bool restir;
+    size_t num_candidates;
+
+    // Spatial reuse of the reservoirs of neighboring pixels from the previous pass
+    bool spatial_reuse;
+    size_t num_reuse_neighbors;
+    int reuse_radius;
+
+    // Shared with the other integrators that are created from the same scene contents
+    std::shared_ptr<Scene> shared_scene;
+    Scene& scene;
+
+    // Camera that is currently rendering using this integrator, set by the camera
+    Camera* camera = nullptr;
 
     const uint8_t min_ray_depth = 3;
     const uint8_t min_priority_ray_depth = 16;
     const uint8_t max_ray_depth = 96; // prevent call stack overflow
+
+private:
+    struct LightSample
+    {
+        const Surface::Base* light = nullptr;
+        glm::dvec3 position;
+    };
+
+    // Weighted reservoir of light samples. W is the unbiased contribution weight of the selected sample.
+    struct Reservoir
+    {
+        LightSample sample;
+        double weight_sum = 0.0, M = 0.0, W = 0.0;
+
+        bool update(const LightSample& candidate, double weight, double count = 1.0);
+    };
+
+    // Primary hit of a pixel and the reservoir of its own candidates
+    struct PixelReservoir
+    {
+        glm::dvec3 position, normal;
+        Reservoir reservoir;
+    };
+
+    LightSample sampleLight() const;
+
+    // Direct light of the sample at the surface point without visibility, per unit area on the light
+    glm::dvec3 unshadowedDirect(const glm::dvec3& position, const glm::dvec3& normal, const LightSample& sample) const;
+    bool visible(const glm::dvec3& position, const glm::dvec3& normal, const LightSample& sample) const;
+
+    glm::dvec3 sampleDirectReservoir(const Interaction& interaction) const;
+
+    // Written by the current pass and read by the next. The primary hit of each pixel is only sampled by one thread.
+    mutable std::vector<PixelReservoir> pixel_reservoirs;
+    std::vector<PixelReservoir> previous_pixel_reservoirs;
+    size_t camera_width = 0;
 };
\ No newline at end of file
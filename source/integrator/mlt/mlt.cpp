@@ -0,0 +1,246 @@
+#include "mlt.hpp"
+
+#include <functional>
+#include <numeric>
+#include <algorithm>
+
+#include <glm/gtx/component_wise.hpp>
+
+#include "../../common/util.hpp"
+#include "../../common/work-queue.hpp"
+#include "../../common/thread-pool.hpp"
+#include "../../common/thread-counters.hpp"
+#include "../../camera/camera.hpp"
+
+MLT::MLT(const nlohmann::json& j) : PathTracer(j)
+{
+    nlohmann::json m = getOptional(j, "mlt", nlohmann::json::object());
+
+    num_bootstrap_samples = std::max(getOptional<size_t>(m, "bootstrap_samples", 100000), size_t(1));
+    num_chains = std::max(getOptional<size_t>(m, "chains", 1000), size_t(1));
+    mutation_size = getOptional(m, "mutation_size", 0.01);
+    large_step_probability = getOptional(m, "large_step_probability", 0.3);
+}
+
+glm::dvec3 MLT::samplePath(glm::ivec2& pixel)
+{
+    const Image& image = camera->image;
+
+    glm::dvec2 pixel_space_pos(Random::unit() * image.width, Random::unit() * image.height);
+    pixel = glm::min(glm::ivec2(pixel_space_pos), glm::ivec2(image.width - 1, image.height - 1));
+
+    glm::dvec3 radiance = PathTracer::sampleRay(camera->generateRay(pixel_space_pos));
+
+    if (!std::isfinite(glm::compAdd(radiance)))
+    {
+        Log("Bias introduced: Non-finite path contribution in MLT::samplePath()");
+        return glm::dvec3(0.0);
+    }
+    return radiance;
+}
+
+void MLT::sampleImage(size_t spp)
+{
+    const size_t num_pixels = camera->image.num_pixels;
+
+    // Each pass replays other chains, also the training and pilot passes of a deterministic render
+    uint64_t base_seed = deterministic ? Random::hash(seed, camera->currentPass()) : Random::engine();
+
+    auto luminance = [](const glm::dvec3& radiance)
+    {
+        return glm::compAdd(radiance) / 3.0;
+    };
+
+    struct Work
+    {
+        Work() : begin(0), end(0) { }
+        Work(size_t begin, size_t end) : begin(begin), end(end) { }
+
+        size_t begin, end;
+    };
+
+    auto runThreads = [](const std::vector<Work>& work_vec, const std::function<void(const Work&)>& f)
+    {
+        WorkQueue<Work> work_queue(work_vec, ThreadPool::get().size());
+        ThreadPool::get().run([&work_queue, &f](size_t worker)
+        {
+            Work work;
+            while (work_queue.getWork(worker, work))
+            {
+                f(work);
+            }
+        });
+    };
+
+    // Bootstrap paths sampled with independent primary samples, seeded by their index so that chains can restart from them
+    std::vector<double> bootstrap_weights(num_bootstrap_samples);
+    std::vector<Work> bootstrap_work;
+    for (size_t i = 0; i < num_bootstrap_samples; i += 1000)
+    {
+        bootstrap_work.emplace_back(i, std::min(i + 1000, num_bootstrap_samples));
+    }
+
+    runThreads(bootstrap_work, [&](const Work& work)
+    {
+        for (size_t i = work.begin; i < work.end; i++)
+        {
+            PrimarySampler sampler(Random::hash(base_seed, i), mutation_size, large_step_probability);
+            Random::sampler = &sampler;
+            glm::ivec2 pixel;
+            bootstrap_weights[i] = luminance(samplePath(pixel));
+            Random::sampler = nullptr;
+        }
+    });
+
+    std::vector<double> cdf(num_bootstrap_samples);
+    std::partial_sum(bootstrap_weights.begin(), bootstrap_weights.end(), cdf.begin());
+
+    // Image plane integral of the luminance, the pixels are scaled by it since the chains are distributed according to luminance
+    double b = cdf.back() / num_bootstrap_samples;
+
+    if (b <= 0.0)
+    {
+        Counters::add(Counters::local().pixels, num_pixels);
+        return;
+    }
+
+    // Each chain takes an equal share of the pixels worth of mutations
+    std::vector<Work> chain_work;
+    size_t chains = std::min(num_chains, num_pixels);
+    for (size_t c = 0; c < chains; c++)
+    {
+        chain_work.emplace_back(c * num_pixels / chains, (c + 1) * num_pixels / chains);
+    }
+
+    runThreads(chain_work, [&](const Work& work)
+    {
+        size_t chain_idx = work.begin;
+
+        std::mt19937_64 engine(Random::hash(base_seed + 1, chain_idx));
+        std::uniform_real_distribution<double> unit_distribution(0.0, std::nextafter(1.0, 0.0));
+
+        size_t bootstrap_idx = std::upper_bound(cdf.begin(), cdf.end(), unit_distribution(engine) * cdf.back()) - cdf.begin();
+        bootstrap_idx = std::min(bootstrap_idx, num_bootstrap_samples - 1);
+
+        PrimarySampler sampler(Random::hash(base_seed, bootstrap_idx), mutation_size, large_step_probability);
+        Random::sampler = &sampler;
+
+        Counters::Thread& counters = Counters::local();
+
+        glm::ivec2 current_pixel;
+        glm::dvec3 current = samplePath(current_pixel);
+        double current_luminance = luminance(current);
+
+        for (size_t p = work.begin; p < work.end; p++)
+        {
+            for (size_t s = 0; s < spp; s++)
+            {
+                sampler.startIteration();
+
+                glm::ivec2 proposed_pixel;
+                glm::dvec3 proposed = samplePath(proposed_pixel);
+                double proposed_luminance = luminance(proposed);
+
+                // The current state can have zero luminance if the replayed bootstrap path didn't reproduce its weight,
+                // e.g. since the radiance cache or the guiding changed, which a proposal with nonzero luminance leaves
+                double accept = 0.0;
+                if (proposed_luminance > 0.0)
+                {
+                    accept = current_luminance > 0.0 ? std::min(1.0, proposed_luminance / current_luminance) : 1.0;
+                }
+
+                // Expected values of both states, instead of only the state that the chain is in
+                if (accept > 0.0)
+                {
+                    camera->splat(proposed_pixel, proposed * (accept * b / proposed_luminance));
+                }
+                if (accept < 1.0 && current_luminance > 0.0)
+                {
+                    camera->splat(current_pixel, current * ((1.0 - accept) * b / current_luminance));
+                }
+
+                if (unit_distribution(engine) < accept)
+                {
+                    current_pixel = proposed_pixel;
+                    current = proposed;
+                    current_luminance = proposed_luminance;
+                    sampler.accept();
+                }
+                else
+                {
+                    sampler.reject();
+                }
+            }
+            Counters::add(counters.pixels);
+            Counters::add(counters.samples, spp);
+        }
+
+        Random::sampler = nullptr;
+    });
+}
+
+double MLT::PrimarySampler::next()
+{
+    if (sample_idx >= samples.size())
+    {
+        samples.resize(sample_idx + 1);
+    }
+    PrimarySample& sample = samples[sample_idx++];
+    mutate(sample);
+    return sample.value;
+}
+
+void MLT::PrimarySampler::mutate(PrimarySample& sample)
+{
+    // Not used since the last accepted large step, which would have replaced it
+    if (sample.last_modified < last_large_step)
+    {
+        sample.value = unit_distribution(engine);
+        sample.last_modified = last_large_step;
+    }
+
+    sample.backup_value = sample.value;
+    sample.backup_modified = sample.last_modified;
+
+    if (large_step)
+    {
+        sample.value = unit_distribution(engine);
+    }
+    else
+    {
+        // Perturbations of all skipped iterations combined into one
+        double n = static_cast<double>(iteration - sample.last_modified);
+        sample.value += normal_distribution(engine) * sigma * std::sqrt(n);
+        sample.value -= std::floor(sample.value);
+        if (sample.value >= 1.0) sample.value = 0.0;
+    }
+    sample.last_modified = iteration;
+}
+
+void MLT::PrimarySampler::startIteration()
+{
+    iteration++;
+    large_step = unit_distribution(engine) < large_step_probability;
+    sample_idx = 0;
+}
+
+void MLT::PrimarySampler::accept()
+{
+    if (large_step)
+    {
+        last_large_step = iteration;
+    }
+}
+
+void MLT::PrimarySampler::reject()
+{
+    for (auto& sample : samples)
+    {
+        if (sample.last_modified == iteration)
+        {
+            sample.value = sample.backup_value;
+            sample.last_modified = sample.backup_modified;
+        }
+    }
+    iteration--;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <vector>
+#include <random>
+#include <atomic>
+
+#include <glm/vec2.hpp>
+#include <glm/vec3.hpp>
+#include <nlohmann/json.hpp>
+
+#include "../path-tracer/path-tracer.hpp"
+#include "../../random/random.hpp"
+
+/*************************************************************************************
+Primary sample space Metropolis light transport, based on "A Simple and Robust Mutation
+Strategy for the Metropolis Light Transport Algorithm" by Kelemen et al. and the
+implementation in "Physically Based Rendering" by Pharr et al.
+
+Every random number drawn through Random while a path is sampled, including the
+position on the image plane, comes from a primary sample vector instead of the engine.
+Paths are sampled by the path tracer, and Markov chains mutate the primary sample
+vectors with small perturbations and independent large steps. The target function is
+the luminance of the path contribution, and its integral over the image is estimated
+by bootstrap paths, which also select the initial states of the chains. The chains
+are independent and run in parallel, and both the current and proposed states are
+splatted to the camera weighted by the acceptance probability.
+**************************************************************************************/
+
+class MLT : public PathTracer
+{
+public:
+    MLT(const nlohmann::json& j);
+
+    virtual bool samplesImage() const { return true; }
+    virtual void sampleImage(size_t spp);
+
+private:
+    class PrimarySampler : public Random::Sampler
+    {
+    public:
+        PrimarySampler(uint64_t seed, double sigma, double large_step_probability)
+            : engine(seed), sigma(sigma), large_step_probability(large_step_probability) { }
+
+        virtual double next();
+
+        void startIteration();
+        void accept();
+        void reject();
+
+    private:
+        struct PrimarySample
+        {
+            double value = 0.0, backup_value = 0.0;
+            int64_t last_modified = 0, backup_modified = 0;
+        };
+
+        // Lazily brings the sample up to date with the mutations of the iterations it wasn't used in
+        void mutate(PrimarySample& sample);
+
+        std::vector<PrimarySample> samples;
+        std::mt19937_64 engine;
+        std::uniform_real_distribution<double> unit_distribution{ 0.0, std::nextafter(1.0, 0.0) };
+        std::normal_distribution<double> normal_distribution;
+
+        double sigma, large_step_probability;
+
+        int64_t iteration = 0, last_large_step = 0;
+        bool large_step = true;
+        size_t sample_idx = 0;
+    };
+
+    // Samples a path using the primary samples of the current thread
+    glm::dvec3 samplePath(glm::ivec2& pixel);
+
+    size_t num_bootstrap_samples, num_chains;
+    double mutation_size, large_step_probability;
+};
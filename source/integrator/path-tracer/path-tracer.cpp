@@ -9,6 +9,22 @@
 #include "../../surface/surface.hpp"
 #include "../../ray/interaction.hpp"
 
+PathTracer::PathTracer(const nlohmann::json& j) : Integrator(j), num_training_passes(0), num_passes_done(0)
+{
+    if (j.find("path_guiding") != j.end())
+    {
+        const nlohmann::json& pg = j.at("path_guiding");
+        num_training_passes = getOptional(pg, "training_passes", 4);
+        bsdf_sampling_fraction = getOptional(pg, "bsdf_sampling_fraction", 0.5);
+        sd_tree = std::make_unique<SDTree>(scene.BB(), pg);
+    }
+
+    if (j.find("radiance_cache") != j.end())
+    {
+        radiance_cache = std::make_unique<RadianceCache>(scene.BB(), j.at("radiance_cache"));
+    }
+}
+
 glm::dvec3 PathTracer::sampleRay(Ray ray)
 {
     if (ray.depth == Integrator::max_ray_depth)
@@ -24,17 +40,64 @@ glm::dvec3 PathTracer::sampleRay(Ray ray)
         return scene.skyColor(ray);
     }
 
-    double survive;
-    if (absorb(ray, intersection, survive))
+    double survive = 1.0;
+    if (!adjoint_rr && absorb(ray, intersection, survive))
     {
         return glm::dvec3(0.0);
     }
 
     Interaction interaction(intersection, ray);
 
+    size_t num_paths = 1;
+    if (adjoint_rr && !(num_paths = rouletteAndSplit(intersection, interaction, survive)))
+    {
+        return glm::dvec3(0.0);
+    }
+
     glm::dvec3 emittance = (ray.depth == 0 || ray.specular || naive) ? interaction.material->emittance : glm::dvec3(0.0);
 
+    bool cacheable = radiance_cache && interaction.type == Interaction::Type::DIFFUSE;
+
+    // Terminate long diffuse chains in the radiance cache
+    glm::dvec3 cached;
+    if (cacheable && ray.diffuse_depth >= radiance_cache->termination_depth && 
+        radiance_cache->lookup(interaction.position, interaction.normal, cached))
+    {
+        return (emittance + cached) / survive;
+    }
+
+    double path_weight = 1.0 / (survive * num_paths);
+
+    glm::dvec3 reflected(0.0);
+    for (size_t i = 0; i < num_paths; i++)
+    {
+        reflected += sampleReflected(interaction, path_weight);
+    }
+
+    reflected /= static_cast<double>(num_paths);
+
+    if (cacheable)
+    {
+        radiance_cache->record(interaction.position, interaction.normal, reflected);
+    }
+
+    return (emittance + reflected) / survive;
+}
+
+// path_weight is the throughput factor of the reflected path from roulette and splitting
+glm::dvec3 PathTracer::sampleReflected(const Interaction& interaction, double path_weight)
+{
+    if (sd_tree && interaction.type == Interaction::Type::DIFFUSE)
+    {
+        return sampleGuidedDiffuse(interaction, path_weight);
+    }
+
     Ray new_ray(interaction);
+    glm::dvec3 BRDF = interaction.BRDF(new_ray.direction);
+
+    double pdf_factor = interaction.type == Interaction::Type::DIFFUSE ? C::PI : 1.0;
+    new_ray.throughput *= path_weight * pdf_factor * glm::compAdd(BRDF) / 3.0;
+
     glm::dvec3 radiance = sampleRay(new_ray);
 
     if (interaction.type == Interaction::Type::DIFFUSE)
@@ -46,5 +109,90 @@ glm::dvec3 PathTracer::sampleRay(Ray ray)
         }       
     }
 
-    return (emittance + interaction.BRDF(new_ray.direction) * radiance) / survive;
+    return BRDF * radiance;
+}
+
+/**************************************************************************
+Samples the reflected radiance at a diffuse interaction by mixing cosine-
+weighted BRDF sampling with the incident radiance distribution learned by 
+the SD-tree. The learned distribution excludes the direct light, since that
+is handled by next event estimation and not by the sampled direction.
+***************************************************************************/
+glm::dvec3 PathTracer::sampleGuidedDiffuse(const Interaction& interaction, double path_weight)
+{
+    DTreeWrapper& dtree = sd_tree->dTree(interaction.position);
+
+    double bsdf_fraction = dtree.sampling.energy() > 0.0 ? bsdf_sampling_fraction : 1.0;
+
+    glm::dvec3 direction = Random::trial(bsdf_fraction) ? 
+        interaction.cs.from(Random::cosWeightedHemiSample()) : dtree.sampling.sample();
+
+    glm::dvec3 radiance = naive ? glm::dvec3(0.0) : Integrator::sampleDirect(interaction);
+
+    double cos_theta = glm::dot(direction, interaction.cs.normal);
+    if (cos_theta <= 0.0 || glm::dot(direction, interaction.normal) <= 0.0)
+    {
+        // Guided direction below the surface, only the direct contribution remains
+        return interaction.BRDF(interaction.cs.from(Random::cosWeightedHemiSample())) * radiance;
+    }
+
+    double pdf = bsdf_fraction * cos_theta * C::INV_PI;
+    if (bsdf_fraction < 1.0)
+    {
+        pdf += (1.0 - bsdf_fraction) * dtree.sampling.pdf(direction);
+    }
+
+    glm::dvec3 BRDF = interaction.BRDF(direction);
+
+    Ray new_ray(interaction, direction);
+    new_ray.throughput *= path_weight * glm::compAdd(BRDF) / 3.0 * cos_theta / pdf;
+
+    glm::dvec3 incident = sampleRay(new_ray);
+
+    if (num_passes_done < num_training_passes)
+    {
+        dtree.building.record(direction, glm::compAdd(incident) / (3.0 * pdf));
+    }
+
+    radiance += incident * cos_theta / pdf;
+
+    return BRDF * radiance;
+}
+
+/*****************************************************************************
+The incident radiance learned by the SD-tree gives a coarse estimate of the 
+diffusely reflected radiance. Direct light is not included in the estimate.
+******************************************************************************/
+double PathTracer::adjointEstimate(const Interaction& interaction) const
+{
+    if (!sd_tree || interaction.type != Interaction::Type::DIFFUSE)
+    {
+        return -1.0;
+    }
+
+    const DTree& dtree = sd_tree->dTree(interaction.position).sampling;
+    if (dtree.numSamples() == 0)
+    {
+        return -1.0;
+    }
+
+    // Cosine factor approximated by its hemispherical average 1/2
+    double incident = dtree.energy() / dtree.numSamples();
+    return glm::compAdd(interaction.material->reflectance) / 3.0 * C::INV_PI * 0.5 * incident;
+}
+
+size_t PathTracer::numTrainingPasses() const
+{
+    return std::max(num_training_passes, Integrator::numTrainingPasses());
+}
+
+void PathTracer::trainingPassDone()
+{
+    Integrator::trainingPassDone();
+
+    num_passes_done++;
+    if (sd_tree && num_passes_done <= num_training_passes)
+    {
+        sd_tree->refine();
+    }
 }
\ No newline at end of file
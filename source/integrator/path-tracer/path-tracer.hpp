@@ -1,14 +1,34 @@
 #pragma once
 
+#include <memory>
+
 #include <nlohmann/json.hpp>
 #include <glm/vec3.hpp>
 
 #include "../integrator.hpp"
+#include "../../guiding/sd-tree.hpp"
+#include "../../cache/radiance-cache.hpp"
 
 class PathTracer : public Integrator
 {
 public:
-    PathTracer(const nlohmann::json& j) : Integrator(j) { }
+    PathTracer(const nlohmann::json& j);
 
     virtual glm::dvec3 sampleRay(Ray ray);
+
+    virtual double adjointEstimate(const Interaction& interaction) const;
+
+    virtual size_t numTrainingPasses() const;
+    virtual void trainingPassDone();
+
+private:
+    glm::dvec3 sampleReflected(const Interaction& interaction, double path_weight);
+    glm::dvec3 sampleGuidedDiffuse(const Interaction& interaction, double path_weight);
+
+    // Only used for path guiding
+    std::unique_ptr<SDTree> sd_tree;
+    size_t num_training_passes, num_passes_done;
+    double bsdf_sampling_fraction;
+
+    std::unique_ptr<RadianceCache> radiance_cache;
 };
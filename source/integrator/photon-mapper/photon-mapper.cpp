@@ -12,8 +12,12 @@
 #include "../../common/work-queue.hpp"
 #include "../../common/constants.hpp"
 #include "../../common/format.hpp"
+#include "../../common/thread-pool.hpp"
+#include "../../common/thread-counters.hpp"
 #include "../../material/material.hpp"
 #include "../../surface/surface.hpp"
+#include "../../camera/camera.hpp"
+#include "../../common/constexpr-math.hpp"
 #include "../../ray/interaction.hpp"
 
 #include "../../octree/octree.cpp"
@@ -35,6 +39,7 @@ PhotonMapper::PhotonMapper(const nlohmann::json& j) : Integrator(j)
     max_node_data = pm.at("max_photons_per_octree_leaf");
     direct_visualization = getOptional(pm, "direct_visualization", false);
     use_shadow_photons = getOptional(pm, "use_shadow_photons", true);
+    light_traced_caustics = getOptional(pm, "light_traced_caustics", false);
 
     min_bounce_distance = 5.0 * max_radius;
     
@@ -57,13 +62,14 @@ PhotonMapper::PhotonMapper(const nlohmann::json& j) : Integrator(j)
 
     struct EmissionWork
     {
-        EmissionWork() : light(), num_emissions(0), photon_flux(0.0) { }
-        EmissionWork(std::shared_ptr<Surface::Base> light, size_t num_emissions, const glm::dvec3& photon_flux)
-            : light(light), num_emissions(num_emissions), photon_flux(photon_flux) { }
+        EmissionWork() : light(), num_emissions(0), photon_flux(0.0), idx(0) { }
+        EmissionWork(std::shared_ptr<Surface::Base> light, size_t num_emissions, const glm::dvec3& photon_flux, size_t idx)
+            : light(light), num_emissions(num_emissions), photon_flux(photon_flux), idx(idx) { }
 
         std::shared_ptr<Surface::Base> light;
         size_t num_emissions;
         glm::dvec3 photon_flux;
+        size_t idx;
     };
 
     std::vector<EmissionWork> work_vec;
@@ -79,140 +85,128 @@ PhotonMapper::PhotonMapper(const nlohmann::json& j) : Integrator(j)
         while (count != num_light_emissions)
         {
             size_t emissions = count + EPW > num_light_emissions ? num_light_emissions - count : EPW;
-            work_vec.emplace_back(light, emissions, photon_flux);
+            work_vec.emplace_back(light, emissions, photon_flux, work_vec.size());
             count += emissions;
         }
     }
 
-    std::shuffle(work_vec.begin(), work_vec.end(), Random::engine);
-    WorkQueue<EmissionWork> work_queue(work_vec);
+    direct_vecs.resize(work_vec.size());
+    indirect_vecs.resize(work_vec.size());
+    caustic_vecs.resize(work_vec.size());
+    shadow_vecs.resize(work_vec.size());
 
-    std::vector<std::unique_ptr<std::thread>> threads(Integrator::num_threads);
+    std::shuffle(work_vec.begin(), work_vec.end(), Random::engine);
+    WorkQueue<EmissionWork> work_queue(work_vec, ThreadPool::get().size());
 
-    direct_vecs.resize(threads.size());
-    indirect_vecs.resize(threads.size());
-    caustic_vecs.resize(threads.size());
-    shadow_vecs.resize(threads.size());
+    ThreadPool& pool = ThreadPool::get();
 
-    for (size_t thread = 0; thread < threads.size(); thread++)
+    std::future<void> emitted = pool.forEachWorker([this, &work_queue](size_t worker)
     {
-        threads[thread] = std::make_unique<std::thread>
-        (
-            [this, &work_queue, thread]()
+        EmissionWork work;
+        while (work_queue.getWork(worker, work))
+        {
+            if (deterministic)
             {
-                EmissionWork work;
-                while (work_queue.getWork(work))
-                {
-                    for (size_t i = 0; i < work.num_emissions; i++)
-                    {
-                        glm::dvec3 pos = (*work.light)(Random::unit(), Random::unit());
-                        glm::dvec3 normal = work.light->normal(pos);
-                        glm::dvec3 dir = CoordinateSystem::from(Random::cosWeightedHemiSample(), normal);
+                Random::seed(seed, work.idx);
+            }
 
-                        pos += normal * C::EPSILON;
+            for (size_t i = 0; i < work.num_emissions; i++)
+            {
+                glm::dvec3 pos = (*work.light)(Random::unit(), Random::unit());
+                glm::dvec3 normal = work.light->normal(pos);
+                glm::dvec3 dir = CoordinateSystem::from(Random::cosWeightedHemiSample(), normal);
 
-                        emitPhoton(Ray(pos, pos + dir, scene.ior), work.photon_flux, thread);
-                    }
-                }
+                pos += normal * C::EPSILON;
+
+                emitPhoton(Ray(pos, pos + dir, scene.ior), work.photon_flux, work.idx);
             }
-        );
-    }
+        }
+    });
 
     auto begin = std::chrono::high_resolution_clock::now();
-    std::unique_ptr<std::thread> print_thread;
     if (print)
     {
         std::cout << std::endl << std::string(28, '-') << "| PHOTON MAPPING PASS |" << std::string(28, '-') << std::endl << std::endl;
         std::cout << "Total number of photon emissions from light sources: " << Format::largeNumber(photon_emissions) << std::endl << std::endl;
-        print_thread = std::make_unique<std::thread>([&work_queue]()
+        do
         {
-            while (!work_queue.empty())
-            {
-                double progress = work_queue.progress();
-                std::cout << std::string("\rPhotons emitted: " + Format::progress(progress));
-                std::this_thread::sleep_for(std::chrono::milliseconds(1000));
-            }
-        });
-        print_thread->join();
+            std::cout << std::string("\rPhotons emitted: " + Format::progress(work_queue.progress()));
+        } while (emitted.wait_for(std::chrono::milliseconds(1000)) != std::future_status::ready);
     }
+    pool.wait(emitted);
 
-    for (auto& thread : threads)
-    {
-        thread->join();
-    }
-
-    std::atomic<bool> done_constructing_octrees = false;
     auto end = std::chrono::high_resolution_clock::now();
     std::string duration = Format::timeDuration(std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count());
+    std::string info = "\rPhotons emitted in " + duration + ". Constructing octrees";
     if (print)
     {
-        std::string info = "\rPhotons emitted in " + duration + ". Constructing octrees";
         std::cout << info;
-        begin = std::chrono::high_resolution_clock::now();
-            
-        print_thread = std::make_unique<std::thread>([&done_constructing_octrees, info]()
-        {
-            std::string dots("");
-            int i = 0;
-            while (!done_constructing_octrees)
-            {
-                std::cout << "\r" + std::string(60, ' ') + info + dots;
-                dots += ".";
-                if (i != 0 && i % 3 == 0) dots = ".";
-                i++;
-                std::this_thread::sleep_for(std::chrono::milliseconds(800));
-            }
-        });
     }
-        
+    begin = std::chrono::high_resolution_clock::now();
+
     size_t num_direct_photons = 0;
     size_t num_indirect_photons = 0;
     size_t num_caustic_photons = 0;
     size_t num_shadow_photons = 0;
 
-    // Erase elements from the vectors as they are inserted in the octree, 
-    // otherwise more memory than needed is used momentarily.
-    auto insertAndPop = [](auto& pvec, auto& pmap)
+    // Insert in emission work order rather than thread order to make the photon maps
+    // independent of how the work was distributed between threads. Elements are erased 
+    // from the vectors as they are inserted in the octree, otherwise more memory than 
+    // needed is used momentarily. The maps are independent and constructed in parallel.
+    bool replicate = getOptional(getOptional(j, "numa", nlohmann::json::object()), "replicate", false);
+
+    auto constructMap = [&work_vec, replicate](auto& vecs, auto& octree, auto& linear_map, size_t& num_photons)
     {
-        auto i = pvec.end();
-        while (i > pvec.begin())
+        for (size_t w = 0; w < work_vec.size(); w++)
         {
-            i--;
-            pmap.insert(*i);
-            i = pvec.erase(i);
+            auto& pvec = vecs[w];
+            num_photons += pvec.size();
+            auto i = pvec.end();
+            while (i > pvec.begin())
+            {
+                i--;
+                octree.insert(*i);
+                i = pvec.erase(i);
+            }
+            pvec.clear();
         }
-        pvec.clear();
-    };
 
-    for (size_t thread = 0; thread < threads.size(); thread++)
-    {
-        num_direct_photons += direct_vecs[thread].size();
-        insertAndPop(direct_vecs[thread], direct_map);
+        // Convert octree to linear array representation
+        linear_map = std::remove_reference_t<decltype(linear_map)>(octree);
 
-        num_indirect_photons += indirect_vecs[thread].size();
-        insertAndPop(indirect_vecs[thread], indirect_map);
+        if (replicate)
+        {
+            linear_map.replicate();
+        }
+    };
 
-        num_caustic_photons += caustic_vecs[thread].size();
-        insertAndPop(caustic_vecs[thread], caustic_map);
+    std::vector<std::future<void>> maps;
+    maps.push_back(pool.submit([&]() { constructMap(direct_vecs, direct_map, linear_direct_map, num_direct_photons); }));
+    maps.push_back(pool.submit([&]() { constructMap(indirect_vecs, indirect_map, linear_indirect_map, num_indirect_photons); }));
+    maps.push_back(pool.submit([&]() { constructMap(caustic_vecs, caustic_map, linear_caustic_map, num_caustic_photons); }));
+    maps.push_back(pool.submit([&]() { constructMap(shadow_vecs, shadow_map, linear_shadow_map, num_shadow_photons); }));
 
-        num_shadow_photons += shadow_vecs[thread].size();
-        insertAndPop(shadow_vecs[thread], shadow_map);
+    std::string dots("");
+    int i = 0;
+    for (auto& map : maps)
+    {
+        while (print && map.wait_for(std::chrono::milliseconds(800)) != std::future_status::ready)
+        {
+            std::cout << "\r" + std::string(60, ' ') + info + dots;
+            dots += ".";
+            if (i != 0 && i % 3 == 0) dots = ".";
+            i++;
+        }
+        pool.wait(map);
     }
 
-    // Convert octrees to linear array representation
-    linear_caustic_map  = LinearOctree<Photon>(caustic_map);
-    linear_direct_map   = LinearOctree<Photon>(direct_map);
-    linear_indirect_map = LinearOctree<Photon>(indirect_map);
-    linear_shadow_map   = LinearOctree<ShadowPhoton>(shadow_map);
-
-    done_constructing_octrees = true;
-
     if (print)
     {
-        print_thread->join();
         end = std::chrono::high_resolution_clock::now();
         std::string duration2 = Format::timeDuration(std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count());
-        std::cout << "\rPhotons emitted in " + duration + ". Octrees constructed in " + duration2 + "." << std::endl << std::endl
+        auto stats = work_queue.stats();
+        std::cout << "\rPhotons emitted in " + duration + ". Octrees constructed in " + duration2 + "." << std::endl
+                  << "Emission work stolen: " << stats.steals << ", Thread idle time: " << Format::progress(100.0 * stats.idle_fraction) << std::endl << std::endl
                   << "Photon maps and numbers of stored photons: " << std::endl << std::endl;
 
         std::cout << std::right
@@ -223,7 +217,7 @@ PhotonMapper::PhotonMapper(const nlohmann::json& j) : Integrator(j)
     }
 }
 
-void PhotonMapper::emitPhoton(const Ray& ray, const glm::dvec3& flux, size_t thread)
+void PhotonMapper::emitPhoton(const Ray& ray, const glm::dvec3& flux, size_t work)
 {
     if (ray.depth == Integrator::max_ray_depth)
     {
@@ -248,21 +242,21 @@ void PhotonMapper::emitPhoton(const Ray& ray, const glm::dvec3& flux, size_t thr
         BRDF *= C::PI;
         if (ray.depth == 0 && Random::trial(non_caustic_reject))
         {
-            direct_vecs[thread].emplace_back(flux / non_caustic_reject, interaction.position, ray.direction);
-            createShadowPhotons(Ray(interaction.position - interaction.normal * C::EPSILON, interaction.position + ray.direction), thread);
+            direct_vecs[work].emplace_back(flux / non_caustic_reject, interaction.position, ray.direction);
+            createShadowPhotons(Ray(interaction.position - interaction.normal * C::EPSILON, interaction.position + ray.direction), work);
         }
         else if (ray.specular)
         {
-            caustic_vecs[thread].emplace_back(flux, interaction.position, ray.direction);
+            caustic_vecs[work].emplace_back(flux, interaction.position, ray.direction);
         }
         else if (Random::trial(non_caustic_reject))
         {
-            indirect_vecs[thread].emplace_back(flux / non_caustic_reject, interaction.position, ray.direction);
+            indirect_vecs[work].emplace_back(flux / non_caustic_reject, interaction.position, ray.direction);
         }
     }
     else if (interaction.type == Interaction::Type::REFLECT && ray.depth == 0 && Random::trial(non_caustic_reject))
     {
-        createShadowPhotons(Ray(interaction.position - interaction.normal * C::EPSILON, interaction.position + ray.direction), thread);
+        createShadowPhotons(Ray(interaction.position - interaction.normal * C::EPSILON, interaction.position + ray.direction), work);
     }
 
     glm::dvec3 new_flux = flux * BRDF;
@@ -272,13 +266,13 @@ void PhotonMapper::emitPhoton(const Ray& ray, const glm::dvec3& flux, size_t thr
 
     if (Random::trial(survive))
     {
-        emitPhoton(new_ray, new_flux / survive, thread);
+        emitPhoton(new_ray, new_flux / survive, work);
     }
 
     return;
 }
 
-void PhotonMapper::createShadowPhotons(const Ray& ray, size_t thread, size_t depth)
+void PhotonMapper::createShadowPhotons(const Ray& ray, size_t work, size_t depth)
 {
     if (!use_shadow_photons || depth > max_ray_depth)
     {
@@ -295,7 +289,7 @@ void PhotonMapper::createShadowPhotons(const Ray& ray, size_t thread, size_t dep
     glm::dvec3 position = ray(intersection.t); 
     if (intersection.surface->material->can_diffusely_reflect)
     {
-        shadow_vecs[thread].emplace_back(position);
+        shadow_vecs[work].emplace_back(position);
     }
 
     glm::dvec3 normal = intersection.surface->normal(position);
@@ -305,7 +299,7 @@ void PhotonMapper::createShadowPhotons(const Ray& ray, size_t thread, size_t dep
     }
 
     glm::dvec3 pos(position - normal * C::EPSILON);
-    createShadowPhotons(Ray(pos, pos + ray.direction), thread, depth + 1);
+    createShadowPhotons(Ray(pos, pos + ray.direction), work, depth + 1);
 }
 
 glm::dvec3 PhotonMapper::sampleRay(Ray ray)
@@ -323,42 +317,69 @@ glm::dvec3 PhotonMapper::sampleRay(Ray ray)
         return glm::dvec3(0.0);
     }
 
-    double survive;
-    if (absorb(ray, intersection, survive))
+    double survive = 1.0;
+    if (!adjoint_rr && absorb(ray, intersection, survive))
     {
         return glm::dvec3(0.0);
     }
 
     Interaction interaction(intersection, ray);
 
+    size_t num_paths = 1;
+    if (adjoint_rr && !(num_paths = rouletteAndSplit(intersection, interaction, survive)))
+    {
+        return glm::dvec3(0.0);
+    }
+
     glm::dvec3 emittance = (ray.depth == 0 || ray.specular) ? interaction.material->emittance : glm::dvec3(0.0);
 
+    auto evaluateDirect = [&]()
+    {
+        if (use_shadow_photons && hasShadowPhotons(interaction) && linear_direct_map.radiusEmpty(interaction.position, max_radius))
+            return glm::dvec3(0.0);
+        else
+            return Integrator::sampleDirect(interaction);
+    };
+
+    // Average of num_paths reflected radiance samples, with the throughput of each reflected path 
+    // scaled by the roulette and splitting weight to keep it relative to the pixel estimate.
+    auto sampleReflected = [&]()
+    {
+        bool diffuse = interaction.type == Interaction::Type::DIFFUSE;
+        double pdf_factor = diffuse ? C::PI : 1.0;
+
+        glm::dvec3 reflected(0.0);
+        for (size_t i = 0; i < num_paths; i++)
+        {
+            Ray new_ray(interaction);
+            glm::dvec3 BRDF = interaction.BRDF(new_ray.direction);
+            new_ray.throughput *= pdf_factor * glm::compAdd(BRDF) / (3.0 * survive * num_paths);
+
+            glm::dvec3 radiance = sampleRay(new_ray) * pdf_factor;
+            if (diffuse)
+            {
+                radiance += evaluateDirect();
+            }
+            reflected += radiance * BRDF;
+        }
+        return reflected / static_cast<double>(num_paths);
+    };
+
     if (interaction.type != Interaction::Type::DIFFUSE)
     {
         // Ray originated from diffuse reflection
         if (ray.depth != 0 && !ray.specular) return emittance / survive;
 
-        Ray new_ray(interaction);
-        return (emittance + sampleRay(new_ray) * interaction.BRDF(new_ray.direction)) / survive;
+        return (emittance + sampleReflected()) / survive;
     }
     else
     {
-        glm::dvec3 caustics = estimateCausticRadiance(interaction);
-
-        auto evaluateDirect = [&]()
-        {
-            if (use_shadow_photons && hasShadowPhotons(interaction) && linear_direct_map.radiusEmpty(interaction.position, max_radius))
-                return glm::dvec3(0.0);
-            else
-                return Integrator::sampleDirect(interaction);
-        };
+        // Caustics of primary rays are splatted by the light traced paths
+        glm::dvec3 caustics = (light_traced_caustics && ray.depth == 0) ? glm::dvec3(0.0) : estimateCausticRadiance(interaction);
 
         auto evaluateDiffuse = [&]()
         {
-            Ray new_ray(interaction);
-            glm::dvec3 BRDF = interaction.BRDF(new_ray.direction);
-            glm::dvec3 indirect = sampleRay(new_ray) * C::PI;
-            return (emittance + caustics + (evaluateDirect() + indirect) * BRDF) / survive;
+            return (emittance + caustics + sampleReflected()) / survive;
         };
 
         if (!direct_visualization && (ray.depth == 0 || ray.specular || interaction.t >= min_bounce_distance))
@@ -393,6 +414,98 @@ glm::dvec3 PhotonMapper::sampleRay(Ray ray)
     }
 }
 
+/*************************************************************************************
+One light path is traced for each primary ray, on the same render threads and from the
+same sample stream as the camera paths. Diffuse vertices reached by specular reflection,
+which would otherwise be stored in the caustic map, are connected to the lens and their
+contributions are splatted to the image. This gives sharp caustics without filtering.
+**************************************************************************************/
+void PhotonMapper::sampleRays(Span<const Ray> rays, Span<glm::dvec3> radiance)
+{
+    Integrator::sampleRays(rays, radiance);
+
+    if (light_traced_caustics)
+    {
+        for (size_t i = 0; i < rays.size(); i++)
+        {
+            traceCausticPath();
+        }
+    }
+}
+
+void PhotonMapper::traceCausticPath() const
+{
+    if (scene.emissives.empty()) return;
+
+    const auto& light = scene.emissives[Random::get<size_t>(0, scene.emissives.size() - 1)];
+
+    glm::dvec3 pos = (*light)(Random::unit(), Random::unit());
+    glm::dvec3 normal = light->normal(pos);
+    glm::dvec3 dir = CoordinateSystem::from(Random::cosWeightedHemiSample(), normal);
+
+    pos += normal * C::EPSILON;
+
+    // Emitted radiance divided by the pdfs of the light, the point on it and the cosine weighted direction
+    glm::dvec3 flux = light->material->emittance * light->area() * static_cast<double>(scene.emissives.size()) * C::PI;
+
+    Ray ray(pos, pos + dir, scene.ior);
+    while (ray.depth < max_ray_depth)
+    {
+        Intersection intersection = scene.intersect(ray);
+
+        if (!intersection) return;
+
+        Interaction interaction(intersection, ray);
+
+        Ray new_ray(interaction);
+        glm::dvec3 BRDF = interaction.BRDF(new_ray.direction);
+
+        if (interaction.type == Interaction::Type::DIFFUSE)
+        {
+            BRDF *= C::PI;
+            if (ray.specular)
+            {
+                splatCaustic(interaction, flux);
+            }
+        }
+
+        glm::dvec3 new_flux = flux * BRDF;
+
+        // Same roulette as for photons
+        double survive = std::min(ray.depth > min_ray_depth ? 0.9 : 1.0, glm::compMax(new_flux) / glm::compMax(flux));
+
+        if (!Random::trial(survive)) return;
+
+        flux = new_flux / survive;
+        ray = new_ray;
+    }
+}
+
+void PhotonMapper::splatCaustic(const Interaction& interaction, const glm::dvec3& flux) const
+{
+    Camera::Connection connection;
+    if (!camera->connect(interaction.position, connection)) return;
+
+    glm::dvec3 to_camera = connection.position - interaction.position;
+    double distance = glm::length(to_camera);
+    glm::dvec3 direction = to_camera / distance;
+
+    double cos_theta = glm::dot(direction, interaction.normal);
+    if (cos_theta <= 0.0) return;
+
+    Counters::add(Counters::local().shadow_rays);
+
+    Ray shadow_ray(interaction.position + interaction.normal * C::EPSILON, connection.position);
+    Intersection shadow_intersection = scene.intersect(shadow_ray);
+    if (shadow_intersection && shadow_intersection.t < distance - C::EPSILON) return;
+
+    // Area pdf of the camera sampling the point, and one light path per sampled pixel for each sample index
+    double camera_pdf = connection.pdf * cos_theta / pow2(distance);
+    double num_paths = static_cast<double>(camera->numSampledPixels());
+
+    camera->splat(connection.pixel, flux * interaction.BRDF(direction) * camera_pdf / num_paths);
+}
+
 glm::dvec3 PhotonMapper::estimateRadiance(const Interaction& interaction, const std::vector<SearchResult<Photon>> &photons)
 {
     glm::dvec3 radiance(0.0);
@@ -14,11 +14,23 @@ class PhotonMapper : public Integrator
 public:
     PhotonMapper(const nlohmann::json& j);
 
-    void emitPhoton(const Ray& ray, const glm::dvec3& flux, size_t thread);
+    void emitPhoton(const Ray& ray, const glm::dvec3& flux, size_t work);
 
-    void createShadowPhotons(const Ray& ray, size_t thread, size_t depth = 0);
+    void createShadowPhotons(const Ray& ray, size_t work, size_t depth = 0);
 
     virtual glm::dvec3 sampleRay(Ray ray);
+    virtual void sampleRays(Span<const Ray> rays, Span<glm::dvec3> radiance);
+
+    virtual bool splatsToCamera() const { return light_traced_caustics; }
+
+    virtual bool rendersConcurrentCameras() const
+    {
+        return !light_traced_caustics && Integrator::rendersConcurrentCameras();
+    }
+
+    // Traces a path from a light source and splats its caustic vertices to the camera
+    void traceCausticPath() const;
+    void splatCaustic(const Interaction& interaction, const glm::dvec3& flux) const;
     
     glm::dvec3 estimateRadiance(const Interaction& interaction, const std::vector<SearchResult<Photon>> &photons);
     glm::dvec3 estimateCausticRadiance(const Interaction& interaction);
@@ -35,8 +47,8 @@ private:
     LinearOctree<Photon> linear_indirect_map;
     LinearOctree<ShadowPhoton> linear_shadow_map;
 
-    // Temporary photon maps which are filled by each thread in the first pass. The Octree can't handle
-    // concurrent inserts, so this has to be done if multi-threading is to be used in the first pass.
+    // Temporary photon maps which are filled by each emission work item in the first pass. The Octree can't
+    // handle concurrent inserts, so this has to be done if multi-threading is to be used in the first pass.
     std::vector<std::vector<Photon>> caustic_vecs;
     std::vector<std::vector<Photon>> direct_vecs;
     std::vector<std::vector<Photon>> indirect_vecs;
@@ -50,6 +62,9 @@ private:
     bool direct_visualization;
     bool use_shadow_photons;
 
+    // Caustics seen directly by the camera are light traced instead of gathered from the caustic map
+    bool light_traced_caustics;
+
     uint16_t max_node_data;
     
     size_t k_nearest_photons;
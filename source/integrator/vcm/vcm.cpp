@@ -0,0 +1,425 @@
+#include "vcm.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <thread>
+
+#include <glm/gtx/component_wise.hpp>
+#include <glm/gtx/norm.hpp>
+
+#include "../../random/random.hpp"
+#include "../../common/util.hpp"
+#include "../../common/work-queue.hpp"
+#include "../../common/constants.hpp"
+#include "../../common/constexpr-math.hpp"
+#include "../../common/format.hpp"
+#include "../../common/thread-pool.hpp"
+#include "../../common/thread-counters.hpp"
+#include "../../material/material.hpp"
+#include "../../surface/surface.hpp"
+#include "../../camera/camera.hpp"
+
+#include "../../octree/octree.cpp"
+#include "../../octree/linear-octree.cpp"
+
+VCM::VCM(const nlohmann::json& j) : VCM(j, true) { }
+
+VCM::VCM(const nlohmann::json& j, bool merging) : Integrator(j)
+{
+    nlohmann::json v = getOptional(j, "vcm", nlohmann::json::object());
+
+    num_light_paths = merging ? getOptional<size_t>(v, "light_paths", 500000) : 0;
+    merge_radius = getOptional(v, "merge_radius", glm::compMax(scene.BB().dimensions()) / 1000.0);
+    size_t max_node_data = getOptional(v, "max_vertices_per_octree_leaf", 190);
+
+    if (num_light_paths)
+    {
+        // Ratio between the merging and connection pdfs of a vertex, the balance heuristic is used
+        double eta = C::PI * pow2(merge_radius) * num_light_paths;
+        vm_weight = eta;
+        vc_weight = 1.0 / eta;
+        vm_normalization = 1.0 / eta;
+    }
+    else
+    {
+        vm_weight = vc_weight = vm_normalization = 0.0;
+        return;
+    }
+
+    const size_t PPW = 10000;
+
+    struct EmissionWork
+    {
+        EmissionWork() : num_paths(0), idx(0) { }
+        EmissionWork(size_t num_paths, size_t idx) : num_paths(num_paths), idx(idx) { }
+
+        size_t num_paths;
+        size_t idx;
+    };
+
+    std::vector<EmissionWork> work_vec;
+    for (size_t count = 0; count < num_light_paths; count += PPW)
+    {
+        work_vec.emplace_back(std::min(PPW, num_light_paths - count), work_vec.size());
+    }
+
+    // Filled by each emission work item and inserted in work order, since the octree can't handle concurrent inserts
+    std::vector<std::vector<LightVertex>> vertex_vecs(work_vec.size());
+
+    std::shuffle(work_vec.begin(), work_vec.end(), Random::engine);
+    WorkQueue<EmissionWork> work_queue(work_vec, ThreadPool::get().size());
+
+    std::cout << std::endl << std::string(29, '-') << "| LIGHT TRACING PASS |" << std::string(29, '-') << std::endl << std::endl;
+    std::cout << "Number of light paths traced for merging: " << Format::largeNumber(num_light_paths) << std::endl << std::endl;
+
+    auto begin = std::chrono::high_resolution_clock::now();
+
+    std::future<void> done = ThreadPool::get().forEachWorker([this, &work_queue, &vertex_vecs](size_t worker)
+    {
+        std::vector<SubpathVertex> path;
+        EmissionWork work;
+        while (work_queue.getWork(worker, work))
+        {
+            if (deterministic)
+            {
+                Random::seed(seed, work.idx);
+            }
+
+            for (size_t i = 0; i < work.num_paths; i++)
+            {
+                path.clear();
+                traceLightPath(path);
+                for (const auto& p : path)
+                {
+                    vertex_vecs[work.idx].push_back(p.vertex);
+                }
+            }
+        }
+    });
+
+    do
+    {
+        std::cout << std::string("\rLight paths traced: " + Format::progress(work_queue.progress()));
+    } while (done.wait_for(std::chrono::milliseconds(1000)) != std::future_status::ready);
+
+    ThreadPool::get().wait(done);
+
+    size_t num_vertices = 0;
+    Octree<LightVertex> octree(scene.BB(), max_node_data);
+    for (auto& vertices : vertex_vecs)
+    {
+        num_vertices += vertices.size();
+        for (const auto& vertex : vertices)
+        {
+            octree.insert(vertex);
+        }
+        vertices = std::vector<LightVertex>();
+    }
+    light_vertices = LinearOctree<LightVertex>(octree);
+
+    auto end = std::chrono::high_resolution_clock::now();
+    std::cout << "\rLight paths traced and stored in " << Format::timeDuration(std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count())
+              << ". Stored vertices: " << Format::largeNumber(num_vertices) << std::endl;
+}
+
+glm::dvec3 VCM::sampleRay(Ray ray)
+{
+    // Light subpath used for the connections of this camera subpath
+    thread_local std::vector<SubpathVertex> light_path;
+    light_path.clear();
+    traceLightPath(light_path);
+
+    // One light subpath is traced per sample, i.e. one per sampled pixel for each sample index
+    double num_subpaths = static_cast<double>(camera->numSampledPixels());
+    for (const auto& light : light_path)
+    {
+        connectCamera(light, num_subpaths);
+    }
+
+    PathState state{ glm::dvec3(1.0), num_subpaths / camera->directionPdf(ray.direction), 0.0, 0.0 };
+
+    glm::dvec3 radiance(0.0);
+    while (ray.depth < max_ray_depth)
+    {
+        Intersection intersection = scene.intersect(ray);
+
+        if (!intersection)
+        {
+            radiance += state.throughput * scene.skyColor(ray);
+            break;
+        }
+
+        Interaction interaction(intersection, ray);
+
+        double cos_in = glm::dot(interaction.normal, interaction.out);
+        if (cos_in <= 0.0) break;
+
+        state.dVCM *= pow2(interaction.t) / cos_in;
+        state.dVC /= cos_in;
+        state.dVM /= cos_in;
+
+        const glm::dvec3& emittance = interaction.material->emittance;
+        if (glm::compMax(emittance) > 0.0)
+        {
+            if (ray.depth == 0)
+            {
+                radiance += state.throughput * emittance;
+            }
+            else
+            {
+                double cos_light = glm::dot(interaction.out, intersection.surface->normal(interaction.position));
+                if (cos_light > 0.0)
+                {
+                    double direct_pdf = 1.0 / (scene.emissives.size() * intersection.surface->area());
+                    double emission_pdf = direct_pdf * cos_light * C::INV_PI;
+                    double w_camera = direct_pdf * state.dVCM + emission_pdf * state.dVC;
+                    radiance += state.throughput * emittance / (1.0 + w_camera);
+                }
+            }
+        }
+
+        if (interaction.type == Interaction::Type::DIFFUSE)
+        {
+            radiance += state.throughput * connectLight(interaction, state);
+
+            for (const auto& light : light_path)
+            {
+                radiance += state.throughput * light.vertex.throughput * connectVertex(interaction, state, light);
+            }
+
+            if (num_light_paths)
+            {
+                radiance += state.throughput * merge(interaction, state);
+            }
+        }
+
+        if (!scatter(interaction, state, ray)) break;
+    }
+    return radiance;
+}
+
+void VCM::traceLightPath(std::vector<SubpathVertex>& path) const
+{
+    if (scene.emissives.empty()) return;
+
+    const auto& light = scene.emissives[Random::get<size_t>(0, scene.emissives.size() - 1)];
+
+    glm::dvec3 pos = (*light)(Random::unit(), Random::unit());
+    glm::dvec3 normal = light->normal(pos);
+    glm::dvec3 local_dir = Random::cosWeightedHemiSample();
+
+    double direct_pdf = 1.0 / (scene.emissives.size() * light->area());
+    double emission_pdf = direct_pdf * local_dir.z * C::INV_PI;
+    if (emission_pdf <= 0.0) return;
+
+    PathState state;
+    state.throughput = light->material->emittance * local_dir.z / emission_pdf;
+    state.dVCM = direct_pdf / emission_pdf;
+    state.dVC = local_dir.z / emission_pdf;
+    state.dVM = state.dVC * vc_weight;
+
+    pos += normal * C::EPSILON;
+    Ray ray(pos, pos + CoordinateSystem::from(local_dir, normal), scene.ior);
+
+    while (ray.depth < max_ray_depth)
+    {
+        Intersection intersection = scene.intersect(ray);
+
+        if (!intersection) return;
+
+        Interaction interaction(intersection, ray);
+
+        double cos_in = glm::dot(interaction.normal, interaction.out);
+        if (cos_in <= 0.0) return;
+
+        state.dVCM *= pow2(interaction.t) / cos_in;
+        state.dVC /= cos_in;
+        state.dVM /= cos_in;
+
+        if (interaction.type == Interaction::Type::DIFFUSE)
+        {
+            path.push_back({ interaction, LightVertex(interaction.position, ray.direction, state.throughput,
+                                                      state.dVCM, state.dVC, state.dVM, continuation(interaction)) });
+        }
+
+        if (!scatter(interaction, state, ray)) return;
+    }
+}
+
+/********************************************************************
+Continues the subpath from the interaction and updates the recursive
+MIS quantities. Returns false if the subpath is terminated.
+*********************************************************************/
+bool VCM::scatter(const Interaction& interaction, PathState& state, Ray& ray) const
+{
+    Ray new_ray(interaction);
+    glm::dvec3 BRDF = interaction.BRDF(new_ray.direction);
+    double cos_out = glm::dot(new_ray.direction, interaction.normal);
+
+    if (interaction.type == Interaction::Type::DIFFUSE)
+    {
+        double survive = continuation(interaction);
+        if (cos_out <= 0.0 || !Random::trial(survive)) return false;
+
+        double dir_pdf = survive * glm::dot(new_ray.direction, interaction.cs.normal) * C::INV_PI;
+        double rev_pdf = survive * std::max(glm::dot(interaction.out, interaction.cs.normal), 0.0) * C::INV_PI;
+        if (dir_pdf <= 0.0) return false;
+
+        state.dVC = (cos_out / dir_pdf) * (state.dVC * rev_pdf + state.dVCM + vm_weight);
+        state.dVM = (cos_out / dir_pdf) * (state.dVM * rev_pdf + state.dVCM * vc_weight + 1.0);
+        state.dVCM = 1.0 / dir_pdf;
+        state.throughput *= BRDF * C::PI / survive;
+    }
+    else
+    {
+        // The forward and reverse pdfs of specular scattering cancel out, so the
+        // roulette can depend on the sampled direction without affecting the weights.
+        double survive = std::min(glm::compMax(BRDF), 1.0);
+        if (!Random::trial(survive)) return false;
+
+        state.dVCM = 0.0;
+        state.dVC *= std::abs(cos_out);
+        state.dVM *= std::abs(cos_out);
+        state.throughput *= BRDF / survive;
+    }
+
+    ray = new_ray;
+    return true;
+}
+
+// Connection of a light subpath vertex to the camera, splatted to the pixel it's seen through
+void VCM::connectCamera(const SubpathVertex& light, double num_subpaths) const
+{
+    const Interaction& interaction = light.interaction;
+    const LightVertex& vertex = light.vertex;
+
+    Camera::Connection connection;
+    if (!camera->connect(vertex.position, connection)) return;
+
+    glm::dvec3 to_camera = connection.position - vertex.position;
+    double distance2 = glm::length2(to_camera);
+    glm::dvec3 direction = to_camera / std::sqrt(distance2);
+
+    double cos_theta = glm::dot(direction, interaction.normal);
+    if (cos_theta <= 0.0) return;
+
+    double rev_pdf = vertex.continuation * std::max(glm::dot(interaction.out, interaction.cs.normal), 0.0) * C::INV_PI;
+
+    // Area pdf of the camera sampling the vertex
+    double camera_pdf = connection.pdf * cos_theta / distance2;
+
+    double w_light = (camera_pdf / num_subpaths) * (vm_weight + vertex.dVCM + vertex.dVC * rev_pdf);
+
+    if (!visible(interaction, connection.position)) return;
+
+    glm::dvec3 radiance = vertex.throughput * interaction.BRDF(direction) * camera_pdf / (num_subpaths * (w_light + 1.0));
+    camera->splat(connection.pixel, radiance);
+}
+
+// Next event estimation, i.e. connection of the camera subpath to a point on a light source
+glm::dvec3 VCM::connectLight(const Interaction& interaction, const PathState& state) const
+{
+    if (scene.emissives.empty()) return glm::dvec3(0.0);
+
+    const auto& light = scene.emissives[Random::get<size_t>(0, scene.emissives.size() - 1)];
+
+    glm::dvec3 light_pos = (*light)(Random::unit(), Random::unit());
+    glm::dvec3 to_light = light_pos - interaction.position;
+    double distance2 = glm::length2(to_light);
+    glm::dvec3 direction = to_light / std::sqrt(distance2);
+
+    double cos_light = glm::dot(-direction, light->normal(light_pos));
+    double cos_theta = glm::dot(direction, interaction.normal);
+    if (cos_light <= 0.0 || cos_theta <= 0.0) return glm::dvec3(0.0);
+
+    double survive = continuation(interaction);
+    double dir_pdf = survive * std::max(glm::dot(direction, interaction.cs.normal), 0.0) * C::INV_PI;
+    double rev_pdf = survive * std::max(glm::dot(interaction.out, interaction.cs.normal), 0.0) * C::INV_PI;
+
+    double direct_pdf_area = 1.0 / (scene.emissives.size() * light->area());
+    double direct_pdf = direct_pdf_area * distance2 / cos_light;
+    double emission_pdf = direct_pdf_area * cos_light * C::INV_PI;
+
+    double w_light = dir_pdf / direct_pdf;
+    double w_camera = (emission_pdf * cos_theta / (direct_pdf * cos_light)) * (vm_weight + state.dVCM + state.dVC * rev_pdf);
+
+    if (!visible(interaction, light_pos)) return glm::dvec3(0.0);
+
+    return light->material->emittance * interaction.BRDF(direction) * cos_theta / (direct_pdf * (w_light + 1.0 + w_camera));
+}
+
+// Connection of the camera subpath to a vertex of the light subpath, excluding the light subpath throughput
+glm::dvec3 VCM::connectVertex(const Interaction& interaction, const PathState& state, const SubpathVertex& light) const
+{
+    const Interaction& light_interaction = light.interaction;
+    const LightVertex& vertex = light.vertex;
+
+    glm::dvec3 to_light = vertex.position - interaction.position;
+    double distance2 = glm::length2(to_light);
+    if (distance2 <= 0.0) return glm::dvec3(0.0);
+    glm::dvec3 direction = to_light / std::sqrt(distance2);
+
+    double cos_camera = glm::dot(direction, interaction.normal);
+    double cos_light = glm::dot(-direction, light_interaction.normal);
+    if (cos_camera <= 0.0 || cos_light <= 0.0) return glm::dvec3(0.0);
+
+    double camera_survive = continuation(interaction);
+    double camera_dir_pdf = camera_survive * std::max(glm::dot(direction, interaction.cs.normal), 0.0) * C::INV_PI;
+    double camera_rev_pdf = camera_survive * std::max(glm::dot(interaction.out, interaction.cs.normal), 0.0) * C::INV_PI;
+    double light_dir_pdf = vertex.continuation * std::max(glm::dot(-direction, light_interaction.cs.normal), 0.0) * C::INV_PI;
+    double light_rev_pdf = vertex.continuation * std::max(glm::dot(light_interaction.out, light_interaction.cs.normal), 0.0) * C::INV_PI;
+
+    // Area pdfs of sampling each vertex from the other
+    double camera_dir_pdf_area = camera_dir_pdf * cos_light / distance2;
+    double light_dir_pdf_area = light_dir_pdf * cos_camera / distance2;
+
+    double w_light = camera_dir_pdf_area * (vm_weight + vertex.dVCM + vertex.dVC * light_rev_pdf);
+    double w_camera = light_dir_pdf_area * (vm_weight + state.dVCM + state.dVC * camera_rev_pdf);
+
+    if (!visible(interaction, vertex.position)) return glm::dvec3(0.0);
+
+    double G = cos_camera * cos_light / distance2;
+    return interaction.BRDF(direction) * light_interaction.BRDF(-direction) * G / (w_light + 1.0 + w_camera);
+}
+
+// Density estimation of the stored light subpath vertices within the merge radius
+glm::dvec3 VCM::merge(const Interaction& interaction, const PathState& state) const
+{
+    auto vertices = light_vertices.radiusSearch(interaction.position, merge_radius);
+
+    double camera_survive = continuation(interaction);
+    double cos_out = std::max(glm::dot(interaction.out, interaction.cs.normal), 0.0);
+
+    glm::dvec3 radiance(0.0);
+    for (const auto& v : vertices)
+    {
+        const LightVertex& vertex = v.data;
+
+        double cos_in = glm::dot(-vertex.direction, interaction.cs.normal);
+        if (cos_in <= 0.0 || glm::dot(vertex.direction, interaction.normal) >= 0.0) continue;
+
+        double camera_dir_pdf = camera_survive * cos_in * C::INV_PI;
+        double camera_rev_pdf = vertex.continuation * cos_out * C::INV_PI;
+
+        double w_light = vertex.dVCM * vc_weight + vertex.dVM * camera_dir_pdf;
+        double w_camera = state.dVCM * vc_weight + state.dVM * camera_rev_pdf;
+
+        radiance += interaction.BRDF(-vertex.direction) * vertex.throughput / (w_light + 1.0 + w_camera);
+    }
+    return radiance * vm_normalization;
+}
+
+// Survival probability of diffuse interactions, which only depends on the material to be usable in the MIS weights
+double VCM::continuation(const Interaction& interaction) const
+{
+    return std::min(glm::compMax(interaction.material->reflectance), 0.9);
+}
+
+bool VCM::visible(const Interaction& interaction, const glm::dvec3& target) const
+{
+    Counters::add(Counters::local().shadow_rays);
+
+    Ray shadow_ray(interaction.position + interaction.normal * C::EPSILON, target);
+    Intersection shadow_intersection = scene.intersect(shadow_ray);
+    return !shadow_intersection || shadow_intersection.t > glm::distance(shadow_ray.start, target) * (1.0 - 1e-7);
+}
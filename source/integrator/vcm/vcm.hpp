@@ -0,0 +1,94 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/vec3.hpp>
+#include <nlohmann/json.hpp>
+
+#include "../integrator.hpp"
+#include "../../ray/interaction.hpp"
+#include "../../octree/linear-octree.hpp"
+
+/*************************************************************************************
+Vertex connection and merging, based on "Light Transport Simulation with Vertex
+Connection and Merging" by Georgiev et al. and the recursive MIS weight formulation
+in "Implementing Vertex Connection and Merging" by Georgiev.
+
+Each camera sample traces a light subpath whose vertices are connected to the camera
+and splatted to the image. The camera subpath is connected to the light sources and
+to the vertices of that light subpath, and it is merged with the vertices of the light
+subpaths traced before rendering, which are gathered from an octree in the same way
+as photons. All strategies are combined with the balance heuristic.
+
+Diffuse interactions are the only vertices that can be connected and merged, and
+specular interactions are treated as delta distributions. The merging radius is fixed.
+**************************************************************************************/
+
+class VCM : public Integrator
+{
+public:
+    VCM(const nlohmann::json& j);
+
+    virtual glm::dvec3 sampleRay(Ray ray);
+
+    // Light subpaths are connected and splatted to the camera
+    virtual bool splatsToCamera() const { return true; }
+    virtual bool rendersConcurrentCameras() const { return false; }
+
+protected:
+    // Bidirectional path tracing if merging is false
+    VCM(const nlohmann::json& j, bool merging);
+
+private:
+    // Diffuse light subpath vertex, stored in the octree for merging
+    struct LightVertex : public OctreeData
+    {
+        LightVertex(const glm::dvec3& position, const glm::dvec3& direction, const glm::dvec3& throughput,
+                    double dVCM, double dVC, double dVM, double continuation)
+            : position(position), direction(direction), throughput(throughput),
+              dVCM(dVCM), dVC(dVC), dVM(dVM), continuation(continuation) { }
+
+        virtual const glm::dvec3& pos() const
+        {
+            return position;
+        }
+
+        glm::dvec3 position, direction, throughput;
+        double dVCM, dVC, dVM, continuation;
+    };
+
+    // Light subpath vertex together with its interaction, used for connections
+    struct SubpathVertex
+    {
+        Interaction interaction;
+        LightVertex vertex;
+    };
+
+    // Throughput and recursive MIS quantities of a subpath
+    struct PathState
+    {
+        glm::dvec3 throughput;
+        double dVCM, dVC, dVM;
+    };
+
+    void traceLightPath(std::vector<SubpathVertex>& path) const;
+
+    bool scatter(const Interaction& interaction, PathState& state, Ray& ray) const;
+
+    void connectCamera(const SubpathVertex& light, double num_subpaths) const;
+    glm::dvec3 connectLight(const Interaction& interaction, const PathState& state) const;
+    glm::dvec3 connectVertex(const Interaction& interaction, const PathState& state, const SubpathVertex& light) const;
+    glm::dvec3 merge(const Interaction& interaction, const PathState& state) const;
+
+    double continuation(const Interaction& interaction) const;
+    bool visible(const Interaction& interaction, const glm::dvec3& target) const;
+
+    LinearOctree<LightVertex> light_vertices;
+
+    // Number of light subpaths stored for merging
+    size_t num_light_paths;
+    double merge_radius;
+
+    // MIS weight factors of merging relative to connection and vice versa, and merging normalization
+    double vm_weight, vc_weight, vm_normalization;
+};
@@ -5,11 +5,107 @@
 #include "camera/camera.hpp"
 
 #include "common/option.hpp"
+#include "common/job.hpp"
+#include "server/render-server.hpp"
+#include "server/distributed.hpp"
+#include "server/preview.hpp"
 #include "random/random.hpp"
 #include "common/util.hpp"
 
+namespace
+{
+    // Renders the jobs of the manifest one after another. Failed jobs are skipped.
+    int runJobs(const std::filesystem::path& manifest)
+    {
+        std::vector<Job> jobs;
+        try
+        {
+            jobs = readJobs(manifest);
+        }
+        catch (const std::exception& ex)
+        {
+            std::cout << ex.what() << std::endl;
+            return -1;
+        }
+
+        // Only the last scene and integrator are kept, which consecutive jobs reuse if they can
+        JobRunner runner(1);
+
+        size_t num_failed = 0;
+        for (size_t i = 0; i < jobs.size(); i++)
+        {
+            std::cout << std::endl << "Job " << i + 1 << "/" << jobs.size() << ": " << jobs[i].scene.string() << std::endl;
+            try
+            {
+                runner.run(jobs[i]);
+            }
+            catch (const std::exception& ex)
+            {
+                std::cout << "Job " << i + 1 << " failed: " << ex.what() << std::endl;
+                num_failed++;
+            }
+        }
+
+        if (num_failed)
+        {
+            std::cout << std::endl << num_failed << " of " << jobs.size() << " jobs failed." << std::endl;
+            return -1;
+        }
+        return 0;
+    }
+
+    // Pastes the crop files over each other and saves the full frame image
+    int mergeCrops(const std::string& output, const std::vector<std::filesystem::path>& crops)
+    {
+        try
+        {
+            Image image = Image::mergeCrops(crops);
+            image.save(output);
+            image.savePFM(output);
+        }
+        catch (const std::exception& ex)
+        {
+            std::cout << ex.what() << std::endl;
+            return -1;
+        }
+        std::cout << "Merged " << crops.size() << " crops into " << output << ".tga and " << output << ".pfm" << std::endl;
+        return 0;
+    }
+}
+
 int main(int argc, char* argv[])
 {
+    if (argc > 2 && std::string(argv[1]) == "--jobs")
+    {
+        return runJobs(argv[2]);
+    }
+
+    if (argc > 2 && std::string(argv[1]) == "--serve")
+    {
+        return RenderServer::serve(static_cast<uint16_t>(std::stoi(argv[2])), argc > 3 ? std::stoul(argv[3]) : 4);
+    }
+
+    if (argc > 3 && std::string(argv[1]) == "--coordinate")
+    {
+        return Distributed::coordinate(static_cast<uint16_t>(std::stoi(argv[2])), argv[3], argc > 4 ? std::stoul(argv[4]) : 600);
+    }
+
+    if (argc > 3 && std::string(argv[1]) == "--work")
+    {
+        return Distributed::work(argv[2], static_cast<uint16_t>(std::stoi(argv[3])), argc > 4 ? argv[4] : "");
+    }
+
+    if (argc > 3 && std::string(argv[1]) == "--merge")
+    {
+        return mergeCrops(argv[2], std::vector<std::filesystem::path>(argv + 3, argv + argc));
+    }
+
+    if (argc > 3 && std::string(argv[1]) == "--preview")
+    {
+        return Preview::run(static_cast<uint16_t>(std::stoi(argv[2])), argv[3], argc > 4 ? std::stoul(argv[4]) : 0,
+                            parseIntegrator(argc > 5 ? argv[5] : "path_tracer"));
+    }
+
     if (argc > 1)
     {
         std::string command_path;
@@ -45,10 +141,16 @@ int main(int argc, char* argv[])
     scene_file >> j;
     scene_file.close();
 
-    std::unique_ptr<Camera> camera;
+    // The scene, BVH and photon maps are built once and shared by all selected cameras
     try
     {
-        camera = std::make_unique<Camera>(j, scene_option);
+        std::vector<nlohmann::json> cameras;
+        for (size_t c : scene_option.cameras)
+        {
+            cameras.push_back(j.at("cameras").at(c));
+        }
+
+        renderCameras(expandFrames(cameras), Camera::createIntegrator(j, scene_option.integrator));
     }
     catch (const std::exception& ex)
     {
@@ -56,7 +158,5 @@ int main(int argc, char* argv[])
         return -1;
     }
 
-    camera->capture();
-    
     return 0;
 }
@@ -3,6 +3,7 @@
 #include <glm/gtx/norm.hpp>
 
 #include "../common/constexpr-math.hpp"
+#include "../common/numa.hpp"
 
 template <class Data>
 LinearOctree<Data>::LinearOctree(Octree<Data> &octree_root)
@@ -17,9 +18,21 @@ LinearOctree<Data>::LinearOctree(Octree<Data> &octree_root)
     compact(&octree_root, df_idx, data_idx, true);
 }
 
+template <class Data>
+void LinearOctree<Data>::replicate()
+{
+    if (NUMA::numNodes() > 1)
+    {
+        auto copies = NUMA::replicate(*this);
+        replicas.assign(std::make_move_iterator(copies.begin()), std::make_move_iterator(copies.end()));
+    }
+}
+
 template <class Data>
 std::vector<SearchResult<Data>> LinearOctree<Data>::knnSearch(const glm::dvec3& p, size_t k, double max_distance) const
 {
+    if (!replicas.empty()) return replicas[NUMA::currentNode()]->knnSearch(p, k, max_distance);
+
     std::vector<SearchResult<Data>> result;
 
     if (linear_tree.empty()) return result;
@@ -82,6 +95,8 @@ std::vector<SearchResult<Data>> LinearOctree<Data>::knnSearch(const glm::dvec3&
 template <class Data>
 std::vector<SearchResult<Data>> LinearOctree<Data>::radiusSearch(const glm::dvec3& p, double radius) const
 {
+    if (!replicas.empty()) return replicas[NUMA::currentNode()]->radiusSearch(p, radius);
+
     std::vector<SearchResult<Data>> result;
     if (linear_tree.empty()) return result;
     recursiveRadiusSearch(root_idx, p, pow2(radius), result);
@@ -91,6 +106,8 @@ std::vector<SearchResult<Data>> LinearOctree<Data>::radiusSearch(const glm::dvec
 template <class Data>
 bool LinearOctree<Data>::radiusEmpty(const glm::dvec3& p, double radius) const
 {
+    if (!replicas.empty()) return replicas[NUMA::currentNode()]->radiusEmpty(p, radius);
+
     bool empty = true;
     if (linear_tree.empty()) return empty;
     recursiveRadiusEmpty(root_idx, p, pow2(radius), empty);
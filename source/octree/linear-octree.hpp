@@ -1,5 +1,7 @@
 #pragma once
 
+#include <memory>
+
 #include "octree.hpp"
 
 template <class Data>
@@ -15,6 +17,9 @@ public:
     std::vector<SearchResult<Data>> radiusSearch(const glm::dvec3& p, double radius) const;
     bool radiusEmpty(const glm::dvec3& p, double radius) const;
 
+    // Copies the octree to each NUMA node, searches then use the copy on the node of the calling thread
+    void replicate();
+
     struct alignas(64) LinearOctant
     {
         BoundingBox BB;
@@ -28,6 +33,8 @@ public:
     std::vector<Data> ordered_data;
 
 private:
+    std::vector<std::shared_ptr<const LinearOctree>> replicas;
+
     void compact(Octree<Data> *node, uint32_t &df_idx, uint64_t &data_idx, bool last = false);
 
     void recursiveRadiusSearch(const uint32_t current, const glm::dvec3& p, double radius2, std::vector<SearchResult<Data>>& result) const;
@@ -2,14 +2,37 @@
 
 #include "../common/constants.hpp"
 
+uint64_t Random::mix(uint64_t z)
+{
+    // SplitMix64 finalizer
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+// Mixed twice to decorrelate seeds of adjacent streams
+uint64_t Random::hash(uint64_t base, uint64_t stream)
+{
+    return mix(mix(base + 0x9E3779B97F4A7C15ull) ^ stream);
+}
+
+void Random::seed(uint64_t base, uint64_t stream)
+{
+    engine.seed(hash(base, stream));
+}
+
 double Random::unit()
 {
+    if (sampler) return sampler->next();
+
     static thread_local std::uniform_real_distribution<double> unit_distribution(0.0, std::nextafter(1.0, 0.0));
     return unit_distribution(engine);
 }
 
 double Random::angle()
 {
+    if (sampler) return sampler->next() * C::TWO_PI;
+
     static thread_local std::uniform_real_distribution<double> angle_distribution(0.0, std::nextafter(C::TWO_PI, 0.0));
     return angle_distribution(engine);
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <random>
+#include <algorithm>
 
 #include <glm/vec3.hpp>
 #include <glm/vec2.hpp>
@@ -10,9 +11,37 @@ namespace Random
     // thread_local to create one differently seeded engine per thread
     inline thread_local std::mt19937_64 engine(std::random_device{}());
 
+    // Source of uniform random numbers that replaces the engine of a thread while set,
+    // used by Metropolis light transport to make all random decisions mutable.
+    class Sampler
+    {
+    public:
+        virtual ~Sampler() { }
+        virtual double next() = 0; // [0,1)
+    };
+
+    inline thread_local Sampler* sampler = nullptr;
+
+    // Re-seeds the engine of the calling thread with a seed derived from a base seed and
+    // a stream index. Used to make sample streams independent of the thread they run on.
+    void seed(uint64_t base, uint64_t stream);
+
+    uint64_t hash(uint64_t base, uint64_t stream);
+
+    // Spreads the bits of z over the whole value, e.g. to spread neighbouring keys over a hash table
+    uint64_t mix(uint64_t z);
+
     template <typename T>
     T get(const T min, const T max) 
     {
+        if (sampler)
+        {
+            if constexpr (std::is_integral<T>::value)
+                return std::min(static_cast<T>(min + sampler->next() * (max - min + 1)), max);
+            else
+                return min + static_cast<T>(sampler->next() * (max - min));
+        }
+
         if constexpr (std::is_integral<T>::value)
             return std::uniform_int_distribution(min, max)(engine); // [min,max]
         else
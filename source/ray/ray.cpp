@@ -9,7 +9,8 @@ Ray::Ray(const glm::dvec3& start, const glm::dvec3& end, double medium_ior)
     : start(start), direction(glm::normalize(end - start)), medium_ior(medium_ior) { }
 
 Ray::Ray(const Interaction &ia)
-    : start(ia.position), depth(ia.ray.depth + 1), diffuse_depth(ia.ray.diffuse_depth)
+    : start(ia.position), depth(ia.ray.depth + 1), diffuse_depth(ia.ray.diffuse_depth),
+      throughput(ia.ray.throughput), pixel_estimate(ia.ray.pixel_estimate)
 {
     switch (ia.type)
     {
@@ -56,6 +57,12 @@ Ray::Ray(const Interaction &ia)
     }
 }
 
+// Diffuse reflection in a direction that has been sampled by other means than the BRDF
+Ray::Ray(const Interaction &ia, const glm::dvec3 &diffuse_direction)
+    : start(ia.position + ia.normal * C::EPSILON), direction(diffuse_direction), medium_ior(ia.n1), 
+      depth(ia.ray.depth + 1), diffuse_depth(ia.ray.diffuse_depth + 1),
+      throughput(ia.ray.throughput), pixel_estimate(ia.ray.pixel_estimate) { }
+
 glm::dvec3 Ray:: operator()(double t) const
 {
     return start + direction * t;
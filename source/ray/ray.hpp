@@ -1,5 +1,7 @@
 #pragma once
 
+#include <cstdint>
+
 #include <glm/vec3.hpp>
 
 #include "../common/coordinate-system.hpp"
@@ -10,6 +12,7 @@ class Ray
 {
 public:
     Ray(const Interaction &ia);
+    Ray(const Interaction &ia, const glm::dvec3 &diffuse_direction);
     Ray(const glm::dvec3& start, const glm::dvec3& end, double medium_ior = 1.0);
 
     glm::dvec3 operator()(double t) const;
@@ -18,4 +21,12 @@ public:
     double medium_ior;
     bool specular = false;
     uint8_t depth = 0, diffuse_depth = 0;
+
+    // Luminance throughput of the path and radiance estimate of the pixel it was traced from (0 if unknown).
+    // Only used by adjoint-driven Russian roulette and splitting.
+    double throughput = 1.0, pixel_estimate = 0.0;
+
+    // Index of the pixel that a primary ray is traced from, -1 for all other rays.
+    // Only used for spatial reuse of direct light reservoirs.
+    int32_t pixel = -1;
 };
\ No newline at end of file
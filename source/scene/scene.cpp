@@ -8,22 +8,88 @@
 #include "../material/material.hpp"
 #include "../surface/surface.hpp"
 #include "../bvh/bvh.hpp"
+#include "../common/thread-counters.hpp"
+#include "../common/lru-cache.hpp"
 
 #include <fstream>
 #include <sstream>
+#include <iterator>
 #include <iostream>
 
-Scene::Scene(const nlohmann::json& j)
+namespace
 {
-    std::unordered_map<std::string, std::shared_ptr<Material>> materials = j.at("materials");
-    auto vertices = getOptional(j, "vertices", std::unordered_map<std::string, std::vector<glm::dvec3>>());
-    ior = getOptional(j, "ior", 1.0);
+    struct ParsedOBJ
+    {
+        std::vector<glm::dvec3> v, n;
+        std::vector<std::vector<size_t>> triangles_v, triangles_vt, triangles_vn;
+    };
 
-    for (const auto& m : j.at("materials").items())
+    // Parsed OBJ files keyed by their contents, scenes keyed by a hash of their contents and 
+    // scenes keyed by a hash of their geometry, whose surfaces and BVH are reused with other materials
+    LRUCache<std::string, std::shared_ptr<const ParsedOBJ>> obj_cache(1);
+    LRUCache<size_t, std::shared_ptr<Scene>> scene_cache(1);
+    LRUCache<size_t, std::shared_ptr<Scene>> geometry_cache(1);
+
+    // Empty if the file can't be read
+    std::string readFile(const std::filesystem::path& path)
     {
-        std::string external_medium = getOptional<std::string>(m.value(), "external_medium", "scene");
-        materials.at(m.key())->external_ior = external_medium == "scene" ? ior : materials.at(external_medium)->ior;
+        std::ifstream file(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    std::string fileKey(const std::string& contents)
+    {
+        return std::to_string(contents.size()) + ":" + std::to_string(std::hash<std::string>()(contents));
+    }
+
+    // Everything that the surfaces and the BVH are built from, i.e. everything but the materials
+    nlohmann::json geometryKey(const nlohmann::json& j)
+    {
+        nlohmann::json key = { { "path", Scene::path.string() } };
+        for (const auto& field : { "vertices", "surfaces", "bvh", "numa" })
+        {
+            if (j.find(field) != j.end()) key[field] = j.at(field);
+        }
+
+        for (auto& s : key.at("surfaces"))
+        {
+            s.erase("material");
+        }
+
+        // Files can change between renders without changing the scene file
+        for (const auto& s : j.at("surfaces"))
+        {
+            if (s.find("file") != s.end())
+            {
+                key["files"].push_back(fileKey(readFile(Scene::path / s.at("file").get<std::string>())));
+            }
+        }
+        return key;
+    }
+
+    nlohmann::json materialKey(nlohmann::json key, const nlohmann::json& j)
+    {
+        for (const auto& field : { "ior", "materials" })
+        {
+            if (j.find(field) != j.end()) key[field] = j.at(field);
+        }
+
+        std::vector<std::string> surface_materials;
+        for (const auto& s : j.at("surfaces"))
+        {
+            surface_materials.push_back(getOptional<std::string>(s, "material", "default"));
+        }
+        key["surface_materials"] = surface_materials;
+        return key;
     }
+}
+
+Scene::Scene(const nlohmann::json& j)
+{
+    auto vertices = getOptional(j, "vertices", std::unordered_map<std::string, std::vector<glm::dvec3>>());
+
+    // Surfaces are bound to their materials after the geometry is built
+    std::unordered_map<std::string, uint32_t> material_indices;
 
     for (const auto& s : j.at("surfaces"))
     {
@@ -32,7 +98,9 @@ Scene::Scene(const nlohmann::json& j)
         {
             material_str = s.at("material");
         }
-        auto& material = materials.at(material_str);
+        auto inserted = material_indices.emplace(material_str, static_cast<uint32_t>(material_names.size()));
+        if (inserted.second) material_names.push_back(material_str);
+        uint32_t material = inserted.first->second;
 
         std::string type = s.at("type");
         if (type == "object")
@@ -42,7 +110,27 @@ Scene::Scene(const nlohmann::json& j)
             if (s.find("file") != s.end())
             {
                 auto obj_path = path / s.at("file").get<std::string>();
-                parseOBJ(obj_path, v, n, triangles_v, triangles_vt, triangles_vn);
+                std::string contents = readFile(obj_path);
+                std::string key = fileKey(contents);
+                if (auto cached = obj_cache.get(key))
+                {
+                    const ParsedOBJ& obj = **cached;
+                    v = obj.v;
+                    n = obj.n;
+                    triangles_v = obj.triangles_v;
+                    triangles_vt = obj.triangles_vt;
+                    triangles_vn = obj.triangles_vn;
+                }
+                else if (!std::filesystem::exists(obj_path))
+                {
+                    std::cout << std::endl << obj_path.string() << " not found.\n";
+                }
+                else
+                {
+                    std::istringstream file(contents);
+                    parseOBJ(file, v, n, triangles_v, triangles_vt, triangles_vn);
+                    obj_cache.put(key, std::make_shared<const ParsedOBJ>(ParsedOBJ{ v, n, triangles_v, triangles_vt, triangles_vn }));
+                }
             }
             else
             {
@@ -64,70 +152,60 @@ Scene::Scene(const nlohmann::json& j)
                 for (auto &p : v) p += origin;
             }
 
-            bool is_emissive = glm::compMax(material->emittance) > C::EPSILON;
+            size_t first_triangle = surfaces.size();
             double total_area = 0.0;
-            if (is_emissive)
-            {
-                for (const auto& t : triangles_v)
-                {
-                    total_area += Surface::Triangle(v.at(t.at(0)), v.at(t.at(1)), v.at(t.at(2)), nullptr).area();
-                }
-            }
-
             for (size_t i = 0; i < triangles_v.size(); i++)
             {
                 const auto &t = triangles_v[i];
 
-                // Entire object emits the flux of assigned material emittance in scene file.
-                // The flux of the material therefore needs to be distributed amongst all object triangles.
-                std::shared_ptr<Material> mat;
-                if (is_emissive && total_area > C::EPSILON)
-                {
-                    double area = Surface::Triangle(v.at(t.at(0)), v.at(t.at(1)), v.at(t.at(2)), nullptr).area();
-                    mat = std::make_shared<Material>(*material);
-                    mat->emittance *= area / total_area;
-                }
-                else
-                {
-                    mat = material;
-                }
-
                 if (smooth)
                 {
                     const auto &tn = triangles_vn[i];
                     surfaces.push_back(std::make_shared<Surface::Triangle>(
                         v.at(t.at(0)), v.at(t.at(1)), v.at(t.at(2)),
-                        n.at(tn.at(0)), n.at(tn.at(1)), n.at(tn.at(2)), mat)
+                        n.at(tn.at(0)), n.at(tn.at(1)), n.at(tn.at(2)), nullptr)
                     );
                 }
                 else
                 {
                     surfaces.push_back(std::make_shared<Surface::Triangle>(
-                        v.at(t.at(0)), v.at(t.at(1)), v.at(t.at(2)), mat)
+                        v.at(t.at(0)), v.at(t.at(1)), v.at(t.at(2)), nullptr)
                     );
                 }
+                total_area += surfaces.back()->area();
+            }
+
+            // Entire object emits the flux of assigned material emittance in scene file.
+            // The flux of the material therefore needs to be distributed amongst all object triangles.
+            for (size_t i = first_triangle; i < surfaces.size(); i++)
+            {
+                if (total_area > C::EPSILON)
+                {
+                    material_slots.push_back({ material, MaterialSlot::Emission::FRACTION, surfaces[i]->area() / total_area });
+                }
+                else
+                {
+                    material_slots.push_back({ material, MaterialSlot::Emission::SHARED, 1.0 });
+                }
             }
         }
         else if (type == "triangle")
         {
             const auto& v = s.at("vertices");
-            surfaces.push_back(std::make_shared<Surface::Triangle>(v.at(0), v.at(1), v.at(2), material));
+            surfaces.push_back(std::make_shared<Surface::Triangle>(v.at(0), v.at(1), v.at(2), nullptr));
+            material_slots.push_back({ material, MaterialSlot::Emission::SHARED, 1.0 });
         }
         else if (type == "sphere")
         {
-            surfaces.push_back(std::make_shared<Surface::Sphere>(s.at("origin"), s.at("radius"), material));
+            surfaces.push_back(std::make_shared<Surface::Sphere>(s.at("origin"), s.at("radius"), nullptr));
+            material_slots.push_back({ material, MaterialSlot::Emission::SHARED, 1.0 });
         }
         else if (type == "quadric")
         {
             // Emittance is not supported for general quadrics 
             // (no parameterization -> no uniform surface sampling or surface area integral)
-            std::shared_ptr<Material> mat = material;
-            if (glm::compMax(material->emittance) > C::EPSILON)
-            {
-                mat = std::make_shared<Material>(*material);
-                mat->emittance = glm::dvec3(0.0);
-            }
-            surfaces.push_back(std::make_shared<Surface::Quadric>(s, mat));
+            surfaces.push_back(std::make_shared<Surface::Quadric>(s, nullptr));
+            material_slots.push_back({ material, MaterialSlot::Emission::NONE, 1.0 });
         }
     }
 
@@ -138,13 +216,76 @@ Scene::Scene(const nlohmann::json& j)
     if (j.find("bvh") != j.end())
     {
         bvh = std::make_shared<BVH>(BB_, surfaces, j.at("bvh"));
+
+        if (getOptional(getOptional(j, "numa", nlohmann::json::object()), "replicate", false))
+        {
+            bvh->replicateNodes();
+        }
+    }
+
+    bindMaterials(j);
+    generateEmissives();
+}
+
+Scene::Scene(const Scene& geometry, const nlohmann::json& j)
+    : material_names(geometry.material_names), material_slots(geometry.material_slots), BB_(geometry.BB_)
+{
+    // The surfaces are copied, since cached scenes and the integrators that use them keep their materials
+    std::unordered_map<const Surface::Base*, std::shared_ptr<Surface::Base>> replacements;
+    surfaces.reserve(geometry.surfaces.size());
+    for (const auto& surface : geometry.surfaces)
+    {
+        surfaces.push_back(surface->clone());
+        replacements.emplace(surface.get(), surfaces.back());
+    }
+
+    if (geometry.bvh)
+    {
+        bvh = std::make_shared<BVH>(*geometry.bvh, replacements);
     }
 
+    bindMaterials(j);
     generateEmissives();
 }
 
+void Scene::bindMaterials(const nlohmann::json& j)
+{
+    std::unordered_map<std::string, std::shared_ptr<Material>> materials = j.at("materials");
+    ior = getOptional(j, "ior", 1.0);
+
+    for (const auto& m : j.at("materials").items())
+    {
+        std::string external_medium = getOptional<std::string>(m.value(), "external_medium", "scene");
+        materials.at(m.key())->external_ior = external_medium == "scene" ? ior : materials.at(external_medium)->ior;
+    }
+
+    std::vector<std::shared_ptr<Material>> bound;
+    for (const auto& name : material_names)
+    {
+        bound.push_back(materials.at(name));
+    }
+
+    for (size_t i = 0; i < surfaces.size(); i++)
+    {
+        const MaterialSlot& slot = material_slots[i];
+        const auto& material = bound[slot.material];
+
+        if (glm::compMax(material->emittance) <= C::EPSILON || slot.emission == MaterialSlot::Emission::SHARED)
+        {
+            surfaces[i]->material = material;
+        }
+        else
+        {
+            surfaces[i]->material = std::make_shared<Material>(*material);
+            surfaces[i]->material->emittance *= slot.emission == MaterialSlot::Emission::FRACTION ? slot.fraction : 0.0;
+        }
+    }
+}
+
 Intersection Scene::intersect(const Ray& ray) const
 {
+    Counters::add(Counters::local().rays);
+
     Intersection intersection;
 
     if (bvh)
@@ -196,21 +337,13 @@ glm::dvec3 Scene::skyColor(const Ray& ray) const
     return glm::mix(glm::dvec3(1.0, 0.5, 0.0), glm::dvec3(0.0, 0.5, 1.0), fy);
 }
 
-void Scene::parseOBJ(const std::filesystem::path &path,
+void Scene::parseOBJ(std::istream &file,
                      std::vector<glm::dvec3> &vertices,
                      std::vector<glm::dvec3> &normals,
                      std::vector<std::vector<size_t>> &triangles_v,
                      std::vector<std::vector<size_t>> &triangles_vt,
                      std::vector<std::vector<size_t>> &triangles_vn) const
 {
-    if (!std::filesystem::exists(path))
-    {
-        std::cout << std::endl << path.string() << " not found.\n";
-        return;
-    }
-
-    std::ifstream file(path);
-
     auto isNumber = [](const std::string &s) 
     {
         return !s.empty() && std::all_of(s.begin(), s.end(), ::isdigit);
@@ -279,8 +412,6 @@ void Scene::parseOBJ(const std::filesystem::path &path,
             if (triangle_vn.size() == 3) triangles_vn.push_back(triangle_vn);
         }
     }
-
-    file.close();
 }
 
 void Scene::generateVertexNormals(std::vector<glm::dvec3> &normals,
@@ -306,4 +437,47 @@ void Scene::generateVertexNormals(std::vector<glm::dvec3> &normals,
     }
 }
 
-std::filesystem::path Scene::path = std::filesystem::current_path() / "scenes";
\ No newline at end of file
+std::filesystem::path Scene::path = std::filesystem::current_path() / "scenes";
+
+std::string Scene::contentKey(const nlohmann::json& j)
+{
+    return materialKey(geometryKey(j), j).dump();
+}
+
+void Scene::setCacheSize(size_t size)
+{
+    obj_cache.resize(size);
+    scene_cache.resize(size);
+    geometry_cache.resize(size);
+}
+
+std::shared_ptr<Scene> Scene::load(const nlohmann::json& j)
+{
+    nlohmann::json geometry = geometryKey(j);
+    size_t geometry_key = std::hash<std::string>()(geometry.dump());
+    size_t key = std::hash<std::string>()(materialKey(geometry, j).dump());
+
+    if (auto cached = scene_cache.get(key))
+    {
+        std::cout << "\nReusing cached scene and BVH." << std::endl;
+        return *cached;
+    }
+
+    std::shared_ptr<Scene> scene;
+    if (auto cached = geometry_cache.get(geometry_key))
+    {
+        std::cout << "\nReusing cached geometry and BVH with new materials." << std::endl;
+        scene_cache.makeRoom(1);
+        scene = std::make_shared<Scene>(**cached, j);
+    }
+    else
+    {
+        // Release the least recently used scenes before the new one is built
+        scene_cache.makeRoom(1);
+        geometry_cache.makeRoom(1);
+        scene = std::make_shared<Scene>(j);
+    }
+    scene_cache.put(key, scene);
+    geometry_cache.put(geometry_key, scene);
+    return scene;
+}
@@ -18,6 +18,21 @@ class Scene
 public:
     Scene(const nlohmann::json& j);
 
+    // Scene with the surfaces and BVH of geometry, which must have been built from the same surfaces, 
+    // bound to the materials of j
+    Scene(const Scene& geometry, const nlohmann::json& j);
+
+    // Returns a cached scene instead of constructing a new one if one was loaded from the same directory 
+    // with the same materials, surfaces and BVH settings, and with unchanged OBJ files. A scene with the
+    // same surfaces but other materials reuses the surfaces and BVH of the cached scene.
+    static std::shared_ptr<Scene> load(const nlohmann::json& j);
+
+    // Number of scenes and parsed OBJ files that are kept in memory for reuse, 1 by default
+    static void setCacheSize(size_t size);
+
+    // Identifies the contents of the scene that load compares
+    static std::string contentKey(const nlohmann::json& j);
+
     Intersection intersect(const Ray& ray) const;
 
     void generateEmissives();
@@ -39,11 +54,27 @@ public:
     static std::filesystem::path path;
 
 private:
+    // Material of each surface, by index in material_names
+    struct MaterialSlot
+    {
+        // Emitting objects distribute the flux of the material among their triangles, while quadrics can't emit
+        enum class Emission { SHARED, FRACTION, NONE };
+
+        uint32_t material;
+        Emission emission;
+        double fraction;
+    };
+
+    std::vector<std::string> material_names;
+    std::vector<MaterialSlot> material_slots;
+
     BoundingBox BB_;
 
     void computeBoundingBox();
 
-    void parseOBJ(const std::filesystem::path &path,
+    void bindMaterials(const nlohmann::json& j);
+
+    void parseOBJ(std::istream &file,
                   std::vector<glm::dvec3> &vertices,
                   std::vector<glm::dvec3> &normals,
                   std::vector<std::vector<size_t>> &triangles_v,
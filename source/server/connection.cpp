@@ -0,0 +1,202 @@
+#include "connection.hpp"
+
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+Connection::Connection(int socket) : socket(socket) { }
+
+Connection::~Connection()
+{
+#ifndef _WIN32
+    close(socket);
+#endif
+}
+
+std::unique_ptr<Connection> Connection::connect(const std::string& host, uint16_t port)
+{
+#ifndef _WIN32
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo* addresses;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0)
+    {
+        return nullptr;
+    }
+
+    std::unique_ptr<Connection> connection;
+    for (addrinfo* a = addresses; a && !connection; a = a->ai_next)
+    {
+        int s = ::socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (s < 0) continue;
+
+        if (::connect(s, a->ai_addr, a->ai_addrlen) == 0)
+            connection = std::make_unique<Connection>(s);
+        else
+            close(s);
+    }
+    freeaddrinfo(addresses);
+    return connection;
+#else
+    return nullptr;
+#endif
+}
+
+int Connection::listen(uint16_t port, bool loopback_only)
+{
+#ifndef _WIN32
+    int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listener < 0) return -1;
+
+    int reuse = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(loopback_only ? INADDR_LOOPBACK : INADDR_ANY);
+    address.sin_port = htons(port);
+
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) < 0 || ::listen(listener, 16) < 0)
+    {
+        close(listener);
+        return -1;
+    }
+    return listener;
+#else
+    return -1;
+#endif
+}
+
+std::unique_ptr<Connection> Connection::accept(int listener)
+{
+#ifndef _WIN32
+    while (true)
+    {
+        int s = ::accept(listener, nullptr, nullptr);
+        if (s >= 0)
+        {
+            // Lets the connection of a worker that disappears without closing it time out eventually
+            int keepalive = 1;
+            setsockopt(s, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive));
+            return std::make_unique<Connection>(s);
+        }
+        if (errno != EINTR && errno != ECONNABORTED) return nullptr;
+    }
+#else
+    return nullptr;
+#endif
+}
+
+void Connection::closeListener(int listener)
+{
+#ifndef _WIN32
+    shutdown(listener, SHUT_RDWR);
+    close(listener);
+#endif
+}
+
+void Connection::setReadTimeout(size_t seconds)
+{
+#ifndef _WIN32
+    timeval timeout = {};
+    timeout.tv_sec = static_cast<time_t>(seconds);
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+#endif
+}
+
+void Connection::shutdownReads()
+{
+#ifndef _WIN32
+    shutdown(socket, SHUT_RD);
+#endif
+}
+
+bool Connection::readLine(std::string& line)
+{
+#ifndef _WIN32
+    size_t end;
+    while ((end = buffer.find('\n')) == std::string::npos)
+    {
+        char data[4096];
+        ssize_t n = recv(socket, data, sizeof(data), 0);
+        if (n <= 0) return false;
+        buffer.append(data, n);
+    }
+    line = buffer.substr(0, end);
+    buffer.erase(0, end + 1);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Connection::read(nlohmann::json& message)
+{
+    std::string line;
+    do
+    {
+        if (!readLine(line)) return false;
+    } while (line.find_first_not_of(" \t\r") == std::string::npos);
+
+    message = nlohmann::json::parse(line);
+    return true;
+}
+
+bool Connection::readBytes(void* data, size_t size)
+{
+#ifndef _WIN32
+    char* out = static_cast<char*>(data);
+
+    // Data that was received together with the last line
+    size_t buffered = std::min(size, buffer.size());
+    std::memcpy(out, buffer.data(), buffered);
+    buffer.erase(0, buffered);
+
+    for (size_t received = buffered; received < size; )
+    {
+        ssize_t n = recv(socket, out + received, size - received, 0);
+        if (n <= 0) return false;
+        received += n;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool Connection::send(const nlohmann::json& message)
+{
+    std::string data = message.dump() + "\n";
+    return sendBytes(data.data(), data.size());
+}
+
+bool Connection::sendBytes(const void* data, size_t size)
+{
+#ifndef _WIN32
+    const char* in = static_cast<const char*>(data);
+    for (size_t sent = 0; sent < size; )
+    {
+        ssize_t n = ::send(socket, in + sent, size - sent, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        sent += n;
+    }
+    return true;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <cstdint>
+
+#include <nlohmann/json.hpp>
+
+/*************************************************************************************
+TCP connection that exchanges newline-terminated JSON messages, optionally followed by
+raw binary data. Sockets are only supported on POSIX systems.
+**************************************************************************************/
+class Connection
+{
+public:
+    explicit Connection(int socket);
+    ~Connection();
+
+    Connection(const Connection&) = delete;
+    Connection& operator=(const Connection&) = delete;
+
+    // Returns nullptr if the connection fails
+    static std::unique_ptr<Connection> connect(const std::string& host, uint16_t port);
+
+    // Returns a listening socket, or -1 if it fails
+    static int listen(uint16_t port, bool loopback_only);
+
+    // Returns nullptr if the listening socket fails or is closed
+    static std::unique_ptr<Connection> accept(int listener);
+
+    // Also wakes up threads that wait in accept
+    static void closeListener(int listener);
+
+    // Reads fail when no data is received for the given number of seconds, 0 waits forever
+    void setReadTimeout(size_t seconds);
+
+    // Makes reads fail, also reads that other threads wait in, while sends still work
+    void shutdownReads();
+
+    // These return false when the other end has disconnected or a read times out
+    bool readLine(std::string& line);
+    bool read(nlohmann::json& message);
+    bool readBytes(void* data, size_t size);
+    bool send(const nlohmann::json& message);
+    bool sendBytes(const void* data, size_t size);
+
+private:
+    int socket;
+    std::string buffer;
+};
@@ -0,0 +1,478 @@
+#include "distributed.hpp"
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+#include <numeric>
+
+#include <nlohmann/json.hpp>
+
+#include "connection.hpp"
+#include "../common/job.hpp"
+#include "../common/format.hpp"
+#include "../camera/camera.hpp"
+#include "../integrator/integrator.hpp"
+
+namespace
+{
+    struct Frame
+    {
+        nlohmann::json job; // message that workers render the frame from
+        std::unique_ptr<Camera> camera;
+        std::vector<Camera::Bucket> buckets;
+        std::deque<uint32_t> pending;
+        size_t num_done = 0, num_assigned = 0;
+
+        // Connected workers that could not render the frame, which fails if all of them could not
+        size_t num_rejected = 0;
+        std::string error;
+    };
+
+    /*************************************************************************************
+    State shared by the threads of the connected workers. Frames are rendered one at a
+    time, and a frame outlives its workers since it is only released when none of its
+    buckets are assigned. Workers only access a frame without holding the mutex while
+    they have buckets of it assigned, and workers that wait for the reply to a job check
+    that the frame is still rendered before using it.
+    **************************************************************************************/
+    struct Coordinator
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+
+        Frame* frame = nullptr;
+        size_t frame_number = 0; // incremented for each frame, so that workers know when to send the next job
+        size_t num_workers = 0;
+        bool finished = false;
+
+        // Connections of all workers, whose reads are shut down when all frames are done
+        std::vector<std::shared_ptr<Connection>> connections;
+
+        // Workers that don't reply or return a batch in time are treated as lost
+        size_t batch_timeout;
+
+        void serveWorker(Connection& connection);
+    };
+
+    void Coordinator::serveWorker(Connection& connection)
+    {
+        size_t batch_size;
+        connection.setReadTimeout(batch_timeout);
+        try
+        {
+            nlohmann::json hello;
+            if (!connection.read(hello)) return;
+
+            // Enough buckets for the threads of the worker to steal from each other
+            batch_size = 2 * std::max(hello.at("hello").get<size_t>(), size_t(1));
+        }
+        catch (const std::exception&)
+        {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(mutex);
+        num_workers++;
+        std::cout << "\r" + std::string(100, ' ') + "\r" << "Worker connected, " << num_workers << " workers." << std::endl;
+
+        size_t sent_frame = 0, rejected_frame = 0;
+        std::vector<uint32_t> batch;
+        bool connected = true;
+        while (connected)
+        {
+            cv.wait(lock, [&]()
+            {
+                return finished || (frame && frame_number != rejected_frame && (frame_number != sent_frame || !frame->pending.empty()));
+            });
+            if (finished) break;
+
+            Frame& f = *frame;
+            size_t number = frame_number;
+
+            if (sent_frame != number)
+            {
+                nlohmann::json job = f.job, reply;
+                lock.unlock();
+                try
+                {
+                    connected = connection.send(job) && connection.read(reply);
+                }
+                catch (const std::exception&)
+                {
+                    connected = false;
+                }
+                lock.lock();
+
+                // The frame may have been completed and released while the worker loaded it
+                sent_frame = number;
+                if (!connected || frame != &f || frame_number != number) continue;
+
+                if (reply.find("error") != reply.end())
+                {
+                    rejected_frame = number;
+                    f.num_rejected++;
+                    f.error = reply.at("error").get<std::string>();
+                    cv.notify_all();
+                }
+                continue;
+            }
+
+            nlohmann::json message = { { "buckets", nlohmann::json::array() } };
+            while (!f.pending.empty() && batch.size() < batch_size)
+            {
+                uint32_t b = f.pending.front();
+                f.pending.pop_front();
+                batch.push_back(b);
+
+                const Camera::Bucket& bucket = f.buckets[b];
+                message["buckets"].push_back({ b, bucket.min.x, bucket.min.y, bucket.max.x, bucket.max.y });
+            }
+            f.num_assigned += batch.size();
+            lock.unlock();
+
+            try
+            {
+                connected = connection.send(message);
+
+                std::vector<glm::dvec3> pixels;
+                while (connected && !batch.empty())
+                {
+                    nlohmann::json header;
+                    auto b = batch.end();
+                    if (connection.read(header))
+                    {
+                        b = std::find(batch.begin(), batch.end(), header.at("bucket").get<uint32_t>());
+                    }
+                    if (b == batch.end())
+                    {
+                        connected = false;
+                        break;
+                    }
+
+                    const Camera::Bucket& bucket = f.buckets[*b];
+                    size_t width = bucket.max.x - bucket.min.x;
+                    pixels.resize(width * (bucket.max.y - bucket.min.y));
+                    if (!connection.readBytes(pixels.data(), pixels.size() * sizeof(glm::dvec3)))
+                    {
+                        connected = false;
+                        break;
+                    }
+
+                    // Buckets do not overlap, so the pixels can be written without the lock
+                    for (size_t i = 0; i < pixels.size(); i++)
+                    {
+                        f.camera->image(bucket.min.x + i % width, bucket.min.y + i / width) = pixels[i];
+                    }
+                    batch.erase(b);
+
+                    std::lock_guard<std::mutex> done_lock(mutex);
+                    f.num_assigned--;
+                    f.num_done++;
+                    cv.notify_all();
+                }
+            }
+            catch (const std::exception&)
+            {
+                connected = false;
+            }
+            lock.lock();
+
+            // Buckets of a lost worker are rendered next by the others
+            if (!batch.empty())
+            {
+                f.pending.insert(f.pending.begin(), batch.begin(), batch.end());
+                f.num_assigned -= batch.size();
+                batch.clear();
+            }
+            cv.notify_all();
+        }
+
+        num_workers--;
+        if (frame && rejected_frame == frame_number)
+        {
+            frame->num_rejected--;
+        }
+        cv.notify_all();
+
+        if (connected)
+        {
+            lock.unlock();
+            connection.send({ { "quit", true } });
+        }
+        else
+        {
+            std::cout << "\r" + std::string(100, ' ') + "\r" << "Worker disconnected, " << num_workers << " workers." << std::endl;
+        }
+    }
+
+    // Renders the frame with the connected workers. Returns false if no worker could render it.
+    bool renderFrame(Coordinator& coordinator, Frame& frame)
+    {
+        std::unique_lock<std::mutex> lock(coordinator.mutex);
+        coordinator.frame = &frame;
+        coordinator.frame_number++;
+        coordinator.cv.notify_all();
+
+        while (true)
+        {
+            bool failed = frame.num_rejected > 0 && frame.num_rejected >= coordinator.num_workers && frame.num_assigned == 0;
+            if (frame.num_done == frame.buckets.size() || failed)
+            {
+                coordinator.frame = nullptr;
+                return !failed;
+            }
+
+            double progress = 100.0 * frame.num_done / frame.buckets.size();
+            std::cout << "\r" + std::string(100, ' ') + "\r" << "Progress: " << Format::progress(progress)
+                      << ", workers: " << coordinator.num_workers << std::flush;
+            coordinator.cv.wait(lock);
+        }
+    }
+}
+
+int Distributed::coordinate(uint16_t port, const std::filesystem::path& manifest, size_t batch_timeout)
+{
+#ifdef _WIN32
+    std::cout << "Distributed rendering is not supported on Windows." << std::endl;
+    return -1;
+#else
+    std::vector<Job> jobs;
+    try
+    {
+        jobs = readJobs(manifest);
+    }
+    catch (const std::exception& ex)
+    {
+        std::cout << ex.what() << std::endl;
+        return -1;
+    }
+
+    int listener = Connection::listen(port, false);
+    if (listener < 0)
+    {
+        std::cout << "Could not listen on port " << port << "." << std::endl;
+        return -1;
+    }
+    std::cout << "Coordinator listening on port " << port << ", waiting for workers." << std::endl;
+
+    Coordinator coordinator;
+    coordinator.batch_timeout = batch_timeout;
+
+    // Only used by the accepting thread until it is joined
+    std::vector<std::thread> worker_threads;
+    std::thread accept_thread([&]()
+    {
+        while (std::shared_ptr<Connection> connection = Connection::accept(listener))
+        {
+            {
+                std::lock_guard<std::mutex> lock(coordinator.mutex);
+                if (coordinator.finished) connection->shutdownReads();
+                coordinator.connections.push_back(connection);
+            }
+            worker_threads.emplace_back([&coordinator, connection]()
+            {
+                coordinator.serveWorker(*connection);
+            });
+        }
+    });
+
+    size_t num_failed = 0;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        const Job& job = jobs[i];
+        std::cout << std::endl << "Job " << i + 1 << "/" << jobs.size() << ": " << job.scene.string() << std::endl;
+
+        std::vector<nlohmann::json> cameras;
+        nlohmann::json scene;
+        try
+        {
+            scene = readScene(job);
+            cameras = jobCameras(job, scene);
+        }
+        catch (const std::exception& ex)
+        {
+            std::cout << "Job " << i + 1 << " failed: " << ex.what() << std::endl;
+            num_failed++;
+            continue;
+        }
+
+        for (size_t k = 0; k < cameras.size(); k++)
+        {
+            auto& c = cameras[k];
+            if (c.find("time_budget") != c.end())
+            {
+                std::cout << "Time budgets are not supported by distributed rendering, the sqrtspp of the camera is used." << std::endl;
+                c.erase("time_budget");
+            }
+
+            Frame frame;
+            try
+            {
+                frame.camera = std::make_unique<Camera>(c, nullptr);
+            }
+            catch (const std::exception& ex)
+            {
+                std::cout << "Camera " << k + 1 << " failed: " << ex.what() << std::endl;
+                num_failed++;
+                continue;
+            }
+            frame.buckets = frame.camera->buckets();
+            frame.pending.resize(frame.buckets.size());
+            std::iota(frame.pending.begin(), frame.pending.end(), 0);
+            frame.job = { { "job", {
+                { "scene", scene },
+                { "directory", job.scene.parent_path().string() },
+                { "integrator", static_cast<int>(job.integrator) },
+                { "camera", c }
+            } } };
+
+            std::cout << std::endl << "Camera " << k + 1 << "/" << cameras.size() << ": " << frame.camera->savename << std::endl;
+
+            auto start = std::chrono::steady_clock::now();
+            if (!renderFrame(coordinator, frame))
+            {
+                std::cout << "\r" + std::string(100, ' ') + "\r" << "No worker could render the camera: " << frame.error << std::endl;
+                num_failed++;
+                continue;
+            }
+
+            frame.camera->saveImage();
+            auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+            std::cout << "\r" + std::string(100, ' ') + "\r" << "Render Completed, Elapsed Time: " << Format::timeDuration(duration.count()) << std::endl;
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(coordinator.mutex);
+        coordinator.finished = true;
+        coordinator.cv.notify_all();
+
+        // Wakes workers that are blocked in a read, e.g. clients that never said hello
+        for (const auto& connection : coordinator.connections)
+        {
+            connection->shutdownReads();
+        }
+    }
+    Connection::closeListener(listener);
+    accept_thread.join();
+    for (auto& thread : worker_threads)
+    {
+        thread.join();
+    }
+
+    if (num_failed)
+    {
+        std::cout << std::endl << num_failed << " jobs or cameras failed." << std::endl;
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+int Distributed::work(const std::string& host, uint16_t port, const std::filesystem::path& scene_directory)
+{
+#ifdef _WIN32
+    std::cout << "Distributed rendering is not supported on Windows." << std::endl;
+    return -1;
+#else
+    auto connection = Connection::connect(host, port);
+    if (!connection)
+    {
+        std::cout << "Could not connect to " << host << ":" << port << "." << std::endl;
+        return -1;
+    }
+    std::cout << "Connected to " << host << ":" << port << "." << std::endl;
+
+    // The pool is only started with the first scene, so the threads of the machine are sent
+    connection->send({ { "hello", std::max(std::thread::hardware_concurrency(), 1u) } });
+
+    // Consecutive frames of the same scene reuse the scene and integrator
+    JobRunner runner(1);
+    std::unique_ptr<Camera> camera;
+
+    try
+    {
+        nlohmann::json message;
+        while (connection->read(message))
+        {
+            if (message.find("quit") != message.end())
+            {
+                std::cout << "All jobs are done." << std::endl;
+                return 0;
+            }
+
+            if (message.find("job") != message.end())
+            {
+                const auto& job = message.at("job");
+                camera.reset();
+                try
+                {
+                    Scene::path = scene_directory.empty() ? std::filesystem::path(job.at("directory").get<std::string>()) : scene_directory;
+                    auto integrator = runner.integrator(job.at("scene"), static_cast<Option::IntegratorType>(job.at("integrator").get<int>()));
+                    if (!integrator->rendersConcurrentCameras())
+                    {
+                        throw std::runtime_error("The integrator does not render pixels independently of each other.");
+                    }
+                    camera = std::make_unique<Camera>(job.at("camera"), integrator);
+                    std::cout << std::endl << "Rendering buckets of " << camera->savename << std::endl;
+                    connection->send({ { "ready", true } });
+                }
+                catch (const std::exception& ex)
+                {
+                    std::cout << "Could not render the job: " << ex.what() << std::endl;
+                    connection->send({ { "error", ex.what() } });
+                }
+            }
+            else if (message.find("buckets") != message.end())
+            {
+                if (!camera)
+                {
+                    throw std::runtime_error("Received buckets without a job.");
+                }
+
+                std::vector<uint32_t> indices;
+                std::vector<Camera::Bucket> buckets;
+                for (const auto& b : message.at("buckets"))
+                {
+                    indices.push_back(b.at(0));
+                    buckets.emplace_back(glm::ivec2(b.at(1).get<int>(), b.at(2).get<int>()), glm::ivec2(b.at(3).get<int>(), b.at(4).get<int>()));
+                }
+
+                camera->sampleBuckets(buckets);
+
+                std::vector<glm::dvec3> pixels;
+                for (size_t i = 0; i < buckets.size(); i++)
+                {
+                    pixels.clear();
+                    for (int y = buckets[i].min.y; y < buckets[i].max.y; y++)
+                    {
+                        for (int x = buckets[i].min.x; x < buckets[i].max.x; x++)
+                        {
+                            pixels.push_back(camera->image(x, y));
+                        }
+                    }
+
+                    if (!connection->send({ { "bucket", indices[i] } }) ||
+                        !connection->sendBytes(pixels.data(), pixels.size() * sizeof(glm::dvec3)))
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        std::cout << "Invalid message from the coordinator: " << ex.what() << std::endl;
+        return -1;
+    }
+
+    std::cout << "Lost the connection to the coordinator." << std::endl;
+    return -1;
+#endif
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <filesystem>
+
+/*************************************************************************************
+Renders the frames of a batch manifest on several machines. The coordinator reads the
+manifest, sends each frame to the connected workers and hands out its buckets in
+batches. Workers render the buckets with all their threads and send the pixels back,
+and the coordinator saves the image when all buckets are done. Buckets of a worker
+that disconnects or stops responding are given to the remaining workers, and workers
+can join at any time.
+
+Since deterministic sample streams are seeded by pixel, the images do not depend on
+which worker rendered which bucket. Only integrators that render each pixel on its
+own are supported, i.e. not ones that splat light paths or train between passes.
+**************************************************************************************/
+namespace Distributed
+{
+    // Returns when all frames are done. Buckets of workers that don't return a batch within
+    // batch_timeout seconds are given to the other workers.
+    int coordinate(uint16_t port, const std::filesystem::path& manifest, size_t batch_timeout);
+
+    // Scenes are read from the directories that the coordinator sends unless scene_directory is given.
+    // Returns when the coordinator is done or disconnects.
+    int work(const std::string& host, uint16_t port, const std::filesystem::path& scene_directory);
+}
@@ -0,0 +1,332 @@
+#include "preview.hpp"
+
+#include <iostream>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+
+#include <nlohmann/json.hpp>
+
+#include "connection.hpp"
+#include "../camera/camera.hpp"
+#include "../integrator/integrator.hpp"
+#include "../random/random.hpp"
+#include "../common/format.hpp"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+#ifndef _WIN32
+    /*************************************************************************************
+    Memory mapped file with a header followed by the linear radiance of the pixels as
+    32-bit floats, RGB from left to right and top to bottom. The pass number is written
+    after the pixels of the pass, so that a viewer can poll it for new passes.
+    **************************************************************************************/
+    class Framebuffer
+    {
+    public:
+        struct Header
+        {
+            char magic[8];
+            uint32_t width, height;
+            uint32_t scale;   // pixels are doubled in blocks of scale x scale pixels
+            uint32_t samples; // samples per pixel at full resolution
+            uint32_t pass;
+        };
+
+        Framebuffer(const std::filesystem::path& path)
+        {
+            file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        }
+
+        ~Framebuffer()
+        {
+            if (header) munmap(header, size);
+            if (file >= 0) close(file);
+        }
+
+        bool valid() const
+        {
+            return file >= 0;
+        }
+
+        // The mapping is only replaced if the resolution changes
+        bool resize(uint32_t width, uint32_t height)
+        {
+            if (header && header->width == width && header->height == height) return true;
+
+            uint32_t pass = header ? header->pass : 0;
+            if (header) munmap(header, size);
+            header = nullptr;
+
+            size = sizeof(Header) + sizeof(float) * 3 * width * height;
+            if (ftruncate(file, size) != 0) return false;
+
+            void* data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+            if (data == MAP_FAILED) return false;
+
+            header = static_cast<Header*>(data);
+            std::memcpy(header->magic, "MCRTPREV", 8);
+            header->width = width;
+            header->height = height;
+            header->scale = header->samples = 0;
+            header->pass = pass;
+            pixels = reinterpret_cast<float*>(header + 1);
+            return true;
+        }
+
+        void write(size_t x, size_t y, const glm::dvec3& radiance)
+        {
+            float* p = pixels + 3 * (y * header->width + x);
+            p[0] = static_cast<float>(radiance.x);
+            p[1] = static_cast<float>(radiance.y);
+            p[2] = static_cast<float>(radiance.z);
+        }
+
+        uint32_t publish(uint32_t scale, uint32_t samples)
+        {
+            header->scale = scale;
+            header->samples = samples;
+            std::atomic_thread_fence(std::memory_order_release);
+            return ++header->pass;
+        }
+
+    private:
+        int file = -1;
+        size_t size = 0;
+        Header* header = nullptr;
+        float* pixels = nullptr;
+    };
+
+    // Camera changes and the connected client of the control connection
+    struct Control
+    {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::vector<nlohmann::json> camera_patches; // merged into the camera before the next pass
+        bool quit = false;
+        std::shared_ptr<Connection> client;
+
+        void send(const nlohmann::json& message)
+        {
+            std::shared_ptr<Connection> c;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                c = client;
+            }
+            if (c) c->send(message);
+        }
+    };
+#endif
+}
+
+int Preview::run(uint16_t port, const std::filesystem::path& scene_file, size_t camera_idx, Option::IntegratorType type)
+{
+#ifdef _WIN32
+    std::cout << "The preview is not supported on Windows." << std::endl;
+    return -1;
+#else
+    std::shared_ptr<Integrator> integrator;
+    nlohmann::json camera_json;
+    try
+    {
+        std::ifstream file(scene_file);
+        if (!file)
+        {
+            throw std::runtime_error("Could not open scene " + scene_file.string());
+        }
+        nlohmann::json j;
+        file >> j;
+
+        camera_json = j.at("cameras").at(camera_idx);
+        Scene::path = std::filesystem::absolute(scene_file).parent_path();
+        integrator = Camera::createIntegrator(j, type);
+        if (!integrator->rendersConcurrentCameras())
+        {
+            throw std::runtime_error("The preview needs an integrator that renders pixels independently of each other.");
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        std::cout << ex.what() << std::endl;
+        return -1;
+    }
+
+    std::filesystem::path framebuffer_path = camera_json.at("savename").get<std::string>() + ".preview";
+    Framebuffer framebuffer(framebuffer_path);
+    if (!framebuffer.valid())
+    {
+        std::cout << "Could not create " << framebuffer_path.string() << "." << std::endl;
+        return -1;
+    }
+
+    int listener = Connection::listen(port, true);
+    if (listener < 0)
+    {
+        std::cout << "Could not listen on port " << port << "." << std::endl;
+        return -1;
+    }
+
+    std::cout << std::endl << "Preview framebuffer: " << framebuffer_path.string() << ", control port: " << port << std::endl;
+
+    Control control;
+    std::thread control_thread([&]()
+    {
+        while (std::shared_ptr<Connection> client = Connection::accept(listener))
+        {
+            {
+                std::lock_guard<std::mutex> lock(control.mutex);
+                control.client = client;
+            }
+
+            while (true)
+            {
+                nlohmann::json message;
+                try
+                {
+                    if (!client->read(message)) break;
+                }
+                catch (const std::exception& ex)
+                {
+                    client->send({ { "event", "error" }, { "message", ex.what() } });
+                    continue;
+                }
+
+                std::lock_guard<std::mutex> lock(control.mutex);
+                if (message.find("quit") != message.end())
+                {
+                    control.quit = true;
+                    control.cv.notify_all();
+                    return;
+                }
+                if (message.find("camera") != message.end())
+                {
+                    control.camera_patches.push_back(message.at("camera"));
+                    control.cv.notify_all();
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(control.mutex);
+            control.client.reset();
+        }
+    });
+
+    const size_t max_scale = 4, max_samples = 1024;
+    const uint64_t seed = integrator->seed;
+
+    std::unique_ptr<Camera> camera;
+    std::vector<glm::dvec3> sum;
+    size_t scale = max_scale, samples = 0;
+    uint32_t pass = 0;
+    auto refine_start = std::chrono::steady_clock::now();
+
+    while (true)
+    {
+        {
+            // Waits for changes when the image has enough samples or the camera is invalid
+            std::unique_lock<std::mutex> lock(control.mutex);
+            control.cv.wait(lock, [&]()
+            {
+                return control.quit || !control.camera_patches.empty() || samples < max_samples;
+            });
+            if (control.quit) break;
+
+            if (!control.camera_patches.empty())
+            {
+                for (const auto& patch : control.camera_patches)
+                {
+                    camera_json.merge_patch(patch);
+                }
+                control.camera_patches.clear();
+                camera.reset();
+                scale = max_scale;
+                samples = 0;
+                refine_start = std::chrono::steady_clock::now();
+            }
+        }
+
+        try
+        {
+            size_t width = camera_json.at("image").at("width"), height = camera_json.at("image").at("height");
+            if (!camera)
+            {
+                // The sensor size is kept, so the field of view is the same at all scales
+                nlohmann::json c = camera_json;
+                c["image"]["width"] = (width + scale - 1) / scale;
+                c["image"]["height"] = (height + scale - 1) / scale;
+                c["sqrtspp"] = 1;
+                c["image"].erase("crop");
+                camera = std::make_unique<Camera>(c, integrator);
+
+                if (!framebuffer.resize(static_cast<uint32_t>(width), static_cast<uint32_t>(height)))
+                {
+                    throw std::runtime_error("Could not map " + framebuffer_path.string());
+                }
+                if (scale == 1) sum.assign(width * height, glm::dvec3(0.0));
+            }
+
+            // New sample streams each pass, otherwise the passes of a seeded scene would be the same
+            integrator->seed = Random::hash(seed, pass);
+            camera->sampleBuckets(camera->buckets());
+
+            if (scale > 1)
+            {
+                for (size_t y = 0; y < height; y++)
+                {
+                    for (size_t x = 0; x < width; x++)
+                    {
+                        framebuffer.write(x, y, camera->image(x / scale, y / scale));
+                    }
+                }
+            }
+            else
+            {
+                samples++;
+                for (size_t y = 0; y < height; y++)
+                {
+                    for (size_t x = 0; x < width; x++)
+                    {
+                        glm::dvec3& s = sum[y * width + x];
+                        s += camera->image(x, y);
+                        framebuffer.write(x, y, s / static_cast<double>(samples));
+                    }
+                }
+            }
+            pass = framebuffer.publish(static_cast<uint32_t>(scale), static_cast<uint32_t>(samples));
+
+            auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - refine_start);
+            std::cout << "\r" + std::string(100, ' ') + "\r" << "Scale: 1/" << scale << ", samples per pixel: " << std::max(samples, size_t(1))
+                      << ", time since change: " << Format::timeDuration(elapsed.count()) << std::flush;
+            control.send({ { "event", "pass" }, { "pass", pass }, { "scale", scale }, { "samples", samples }, { "milliseconds", elapsed.count() } });
+
+            if (scale > 1)
+            {
+                scale /= 2;
+                camera.reset();
+            }
+        }
+        catch (const std::exception& ex)
+        {
+            std::cout << std::endl << "Invalid camera: " << ex.what() << std::endl;
+            control.send({ { "event", "error" }, { "message", ex.what() } });
+            camera.reset();
+            samples = max_samples;
+        }
+    }
+
+    integrator->seed = seed;
+    Connection::closeListener(listener);
+    control_thread.join();
+    std::cout << std::endl;
+    return 0;
+#endif
+}
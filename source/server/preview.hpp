@@ -0,0 +1,20 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+
+#include "../common/option.hpp"
+
+/*************************************************************************************
+Progressive preview for framing shots. A camera of the scene is rendered with one
+sample per pixel, first at a quarter and half of the resolution with pixel doubling
+and then at full resolution, where the passes are averaged. Each pass is published to
+a memory mapped framebuffer file that an external viewer can poll, and a control
+connection on localhost can change the camera, which restarts the refinement without
+rebuilding the scene or the integrator.
+**************************************************************************************/
+namespace Preview
+{
+    // Returns when a control connection sends quit or the preview fails
+    int run(uint16_t port, const std::filesystem::path& scene_file, size_t camera, Option::IntegratorType type);
+}
@@ -0,0 +1,115 @@
+#include "render-server.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <chrono>
+#include <filesystem>
+
+#include <nlohmann/json.hpp>
+
+#include "../common/job.hpp"
+#include "../common/util.hpp"
+#include "../camera/camera.hpp"
+#include "connection.hpp"
+
+namespace
+{
+    std::string base64(const std::string& data)
+    {
+        static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+        std::string out;
+        out.reserve((data.size() + 2) / 3 * 4);
+        for (size_t i = 0; i < data.size(); i += 3)
+        {
+            uint32_t n = static_cast<uint8_t>(data[i]) << 16;
+            if (i + 1 < data.size()) n |= static_cast<uint8_t>(data[i + 1]) << 8;
+            if (i + 2 < data.size()) n |= static_cast<uint8_t>(data[i + 2]);
+
+            out += table[(n >> 18) & 63];
+            out += table[(n >> 12) & 63];
+            out += i + 1 < data.size() ? table[(n >> 6) & 63] : '=';
+            out += i + 2 < data.size() ? table[n & 63] : '=';
+        }
+        return out;
+    }
+}
+
+int RenderServer::serve(uint16_t port, size_t cache_size)
+{
+#ifdef _WIN32
+    std::cout << "The render server is not supported on Windows." << std::endl;
+    return -1;
+#else
+    // Only local clients, since requests can read and write arbitrary files
+    int listener = Connection::listen(port, true);
+    if (listener < 0)
+    {
+        std::cout << "Could not listen on port " << port << "." << std::endl;
+        return -1;
+    }
+
+    std::cout << "Render server listening on 127.0.0.1:" << port << ", caching " << cache_size << " scenes and integrators." << std::endl;
+
+    JobRunner runner(cache_size);
+
+    while (true)
+    {
+        std::unique_ptr<Connection> client = Connection::accept(listener);
+        if (!client)
+        {
+            std::cout << "The server socket failed." << std::endl;
+            return -1;
+        }
+
+        Connection& connection = *client;
+        std::string line;
+        while (connection.readLine(line))
+        {
+            if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+
+            auto start = std::chrono::steady_clock::now();
+            try
+            {
+                nlohmann::json request = nlohmann::json::parse(line);
+                std::filesystem::path directory = getOptional<std::string>(request, "directory", std::filesystem::current_path().string());
+                bool send_images = getOptional(request, "send_images", true);
+                Job job = parseJob(request, directory);
+
+                std::cout << std::endl << "Request: " << (job.scene_json.is_null() ? job.scene.string() : "inline scene") << std::endl;
+                connection.send({ { "event", "started" } });
+
+                auto progress = [&connection](double progress)
+                {
+                    connection.send({ { "event", "progress" }, { "progress", progress } });
+                };
+
+                auto captured = [&connection, send_images](const Camera& camera)
+                {
+                    nlohmann::json message = { { "event", "image" }, { "file", camera.savename + ".tga" } };
+                    if (send_images)
+                    {
+                        std::ifstream image(camera.savename + ".tga", std::ios::binary);
+                        std::stringstream data;
+                        data << image.rdbuf();
+                        message["tga"] = base64(data.str());
+                    }
+                    connection.send(message);
+                };
+
+                runner.run(job, progress, captured);
+
+                double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+                connection.send({ { "event", "done" }, { "seconds", seconds } });
+            }
+            catch (const std::exception& ex)
+            {
+                std::cout << "Request failed: " << ex.what() << std::endl;
+                connection.send({ { "event", "error" }, { "message", ex.what() } });
+            }
+        }
+    }
+#endif
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+/*************************************************************************************
+Long-running render server for quick re-renders of the same scenes. Clients connect 
+to the port on localhost and send render jobs as JSON objects, one per line, in the 
+same format as the jobs of a batch manifest. The server replies with one JSON object 
+per line for the progress, the rendered images and the result of each job. Scenes, 
+parsed OBJ files and integrators are cached between jobs, so that only the parts of 
+a scene that changed are rebuilt. Jobs are rendered one at a time.
+**************************************************************************************/
+namespace RenderServer
+{
+    // Returns when the server fails, otherwise never
+    int serve(uint16_t port, size_t cache_size);
+}
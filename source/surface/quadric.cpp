@@ -65,6 +65,11 @@ Surface::Quadric::Quadric(const nlohmann::json &j, std::shared_ptr<Material> mat
     computeBoundingBox();
 }
 
+std::shared_ptr<Surface::Base> Surface::Quadric::clone() const
+{
+    return std::make_shared<Quadric>(*this);
+}
+
 /**********************************************************************
  Ray equation: r = o + d*t
  Quadric equation: transpose(p)*Q*p = 0
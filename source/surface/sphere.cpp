@@ -10,6 +10,11 @@ Surface::Sphere::Sphere(const glm::dvec3& origin, double radius, std::shared_ptr
     computeBoundingBox();
 }
 
+std::shared_ptr<Surface::Base> Surface::Sphere::clone() const
+{
+    return std::make_shared<Sphere>(*this);
+}
+
 bool Surface::Sphere::intersect(const Ray& ray, Intersection& intersection) const
 {
     glm::dvec3 so = ray.start - origin;
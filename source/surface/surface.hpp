@@ -20,6 +20,9 @@ namespace Surface
 
         virtual ~Base() { }
 
+        // Copy of the surface, which is given its own material by scenes that share the geometry
+        virtual std::shared_ptr<Base> clone() const = 0;
+
         virtual bool intersect(const Ray& ray, Intersection& intersection) const = 0;
         virtual glm::dvec3 operator()(double u, double v) const = 0;
         virtual glm::dvec3 normal(const glm::dvec3& pos) const = 0;
@@ -53,6 +56,7 @@ namespace Surface
     public:
         Sphere(const glm::dvec3& origin, double radius, std::shared_ptr<Material> material);
 
+        virtual std::shared_ptr<Base> clone() const;
         virtual bool intersect(const Ray& ray, Intersection& intersection) const;
         virtual glm::dvec3 operator()(double u, double v) const;
         virtual glm::dvec3 normal(const glm::dvec3& pos) const;
@@ -74,6 +78,9 @@ namespace Surface
         Triangle(const glm::dvec3& v0, const glm::dvec3& v1, const glm::dvec3& v2,
                  const glm::dvec3& n0, const glm::dvec3& n1, const glm::dvec3& n2, std::shared_ptr<Material> material);
 
+        Triangle(const Triangle& triangle);
+
+        virtual std::shared_ptr<Base> clone() const;
         virtual bool intersect(const Ray& ray, Intersection& intersection) const;
         virtual glm::dvec3 operator()(double u, double v) const;
         virtual glm::dvec3 normal(const glm::dvec3& pos) const;
@@ -97,6 +104,7 @@ namespace Surface
     public:
         Quadric(const nlohmann::json &j, std::shared_ptr<Material> material);
 
+        virtual std::shared_ptr<Base> clone() const;
         virtual bool intersect(const Ray& ray, Intersection& intersection) const;
         virtual glm::dvec3 operator()(double u, double v) const;
         virtual glm::dvec3 normal(const glm::dvec3& pos) const;
@@ -18,6 +18,16 @@ Surface::Triangle::Triangle(const glm::dvec3& v0, const glm::dvec3& v1, const gl
     computeBoundingBox();
 }
 
+Surface::Triangle::Triangle(const Triangle& triangle)
+    : Base(triangle), v0(triangle.v0), v1(triangle.v1), v2(triangle.v2),
+      N(triangle.N ? std::make_unique<const glm::dmat3>(*triangle.N) : nullptr),
+      E1(triangle.E1), E2(triangle.E2), normal_(triangle.normal_) { }
+
+std::shared_ptr<Surface::Base> Surface::Triangle::clone() const
+{
+    return std::make_shared<Triangle>(*this);
+}
+
 bool Surface::Triangle::intersect(const Ray& ray, Intersection& intersection) const
 {
     glm::dvec3 P = glm::cross(ray.direction, E2);